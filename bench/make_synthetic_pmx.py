@@ -0,0 +1,273 @@
+#!/usr/bin/env python3
+"""Writes a synthetic PMX 2.0 model for bench/pmx_parse_bench.cpp.
+
+Every section of the format is populated, with all five skin weight types,
+IK bones and each morph kind, so the parser takes all of its code paths.
+"""
+import argparse
+import random
+import struct
+
+
+def main():
+    ap = argparse.ArgumentParser()
+    ap.add_argument("output")
+    ap.add_argument("--vertices", type=int, default=200000)
+    ap.add_argument("--materials", type=int, default=40)
+    ap.add_argument("--bones", type=int, default=300)
+    ap.add_argument("--morphs", type=int, default=200)
+    ap.add_argument("--morph-elements", type=int, default=400)
+    ap.add_argument("--textures", type=int, default=30)
+    ap.add_argument("--utf8", action="store_true")
+    ap.add_argument("--additional-uvs", type=int, default=0)
+    ap.add_argument("--seed", type=int, default=1)
+    a = ap.parse_args()
+    rnd = random.Random(a.seed)
+
+    def isize(n):
+        return 1 if n < 127 else (2 if n < 32767 else 4)
+
+    def vsize(n):
+        return 1 if n < 255 else (2 if n < 65535 else 4)
+
+    out = bytearray()
+
+    def u1(v):
+        out.extend(struct.pack("<B", v))
+
+    def u2(v):
+        out.extend(struct.pack("<H", v))
+
+    def u4(v):
+        out.extend(struct.pack("<I", v))
+
+    def f4(*vs):
+        for v in vs:
+            out.extend(struct.pack("<f", v))
+
+    def text(s):
+        b = s.encode("utf-8" if a.utf8 else "utf-16-le")
+        u4(len(b))
+        out.extend(b)
+
+    def idx(v, size, signed=True):
+        if size == 1:
+            out.extend(struct.pack("<b" if signed else "<B", v))
+        elif size == 2:
+            out.extend(struct.pack("<h" if signed else "<H", v))
+        else:
+            out.extend(struct.pack("<i" if signed else "<I", v))
+
+    vis = vsize(a.vertices)
+    tis = isize(a.textures)
+    mis = isize(a.materials)
+    bis = isize(a.bones)
+    mois = isize(a.morphs)
+    ris = 1
+
+    out.extend(b"PMX ")
+    f4(2.0)
+    u1(8)
+    u1(1 if a.utf8 else 0)
+    u1(a.additional_uvs)
+    for s in (vis, tis, mis, bis, mois, ris):
+        u1(s)
+    text("合成モデル")
+    text("synthetic model")
+    text("コメント\n二行目")
+    text("comment")
+
+    u4(a.vertices)
+    for i in range(a.vertices):
+        f4(rnd.uniform(-10, 10), rnd.uniform(0, 20), rnd.uniform(-5, 5))
+        f4(0.0, 1.0, 0.0)
+        f4(rnd.random(), rnd.random())
+        for _ in range(a.additional_uvs):
+            f4(rnd.random(), rnd.random(), rnd.random(), rnd.random())
+        t = i % 5
+        u1(t)
+        b = [rnd.randrange(a.bones) for _ in range(4)]
+        if t == 0:
+            idx(b[0], bis)
+        elif t == 1:
+            idx(b[0], bis)
+            idx(b[1], bis)
+            f4(0.75)
+        elif t == 2:
+            idx(b[0], bis)
+            idx(b[1], bis)
+            idx(b[2], bis)
+            idx(-1, bis)
+            f4(0.5, 0.25, 0.25, 0.0)
+        elif t == 3:
+            idx(b[0], bis)
+            idx(b[1], bis)
+            f4(0.6)
+            f4(1, 2, 3)
+            f4(4, 5, 6)
+            f4(7, 8, 9)
+        else:
+            for k in range(4):
+                idx(b[k], bis)
+            f4(0.4, 0.3, 0.2, 0.1)
+        f4(1.0)
+
+    faces = a.vertices * 2
+    u4(faces * 3)
+    for _ in range(faces):
+        v = rnd.randrange(a.vertices - 2)
+        for k in (v, v + 1, v + 2):
+            idx(k, vis, signed=False)
+
+    u4(a.textures)
+    for i in range(a.textures):
+        text("tex\\Body_%02d.png" % i)
+
+    u4(a.materials)
+    per = (faces // a.materials) * 3
+    remaining = faces * 3
+    for i in range(a.materials):
+        text("材質%d" % i)
+        text("material%d" % i)
+        f4(1.0, 0.8, 0.7, 1.0)
+        f4(0.1, 0.1, 0.1)
+        f4(5.0)
+        f4(0.5, 0.5, 0.5)
+        u1(0x1F)
+        f4(0, 0, 0, 1)
+        f4(1.0)
+        idx(i % a.textures if i % 7 else -1, tis)
+        idx(-1, tis)
+        u1(0)
+        if i % 2:
+            u1(1)
+            u1(3)
+        else:
+            u1(0)
+            idx(-1, tis)
+        text("")
+        count = per if i < a.materials - 1 else remaining
+        remaining -= count
+        u4(count)
+
+    u4(a.bones)
+    for i in range(a.bones):
+        text("ボーン%d" % i)
+        text("bone%d" % i)
+        f4(0.0, i * 0.1, 0.0)
+        idx(i - 1, bis)
+        u4(0)
+        flags = 0x001E
+        if i % 3 == 0:
+            flags |= 0x0001
+        if i % 11 == 0:
+            flags |= 0x0020
+        if i % 13 == 0:
+            flags |= 0x0100
+        if i % 17 == 0:
+            flags |= 0x0400
+        if i % 19 == 0:
+            flags |= 0x0800
+        if i % 23 == 0:
+            flags |= 0x2000
+        u2(flags)
+        if flags & 0x0001:
+            idx(min(i + 1, a.bones - 1), bis)
+        else:
+            f4(0.0, 0.1, 0.0)
+        if flags & 0x0300:
+            idx(0, bis)
+            f4(0.5)
+        if flags & 0x0400:
+            f4(1, 0, 0)
+        if flags & 0x0800:
+            f4(1, 0, 0)
+            f4(0, 0, 1)
+        if flags & 0x2000:
+            u4(7)
+        if flags & 0x0020:
+            idx(0, bis)
+            u4(40)
+            f4(0.5)
+            u4(2)
+            idx(1, bis)
+            u1(1)
+            f4(-1, 0, 0)
+            f4(0, 0, 0)
+            idx(2, bis)
+            u1(0)
+
+    u4(a.morphs)
+    for i in range(a.morphs):
+        text("モーフ%d" % i)
+        text("morph%d" % i)
+        u1(1 + i % 4)
+        t = i % 11
+        u1(t)
+        n = a.morph_elements if t == 1 else 8
+        u4(n)
+        for e in range(n):
+            if t in (0, 9):
+                idx(e % a.morphs, mois)
+                f4(1.0)
+            elif t == 1:
+                idx(rnd.randrange(a.vertices), vis, signed=False)
+                f4(0.1, 0.2, 0.3)
+            elif t == 2:
+                idx(e % a.bones, bis)
+                f4(0, 0, 0)
+                f4(0, 0, 0, 1)
+            elif t in (3, 4, 5, 6, 7):
+                idx(rnd.randrange(a.vertices), vis, signed=False)
+                f4(0.1, 0.1, 0, 0)
+            elif t == 8:
+                idx(e % a.materials, mis)
+                u1(0)
+                f4(*([1.0] * 28))
+            else:
+                idx(0, ris)
+                u1(0)
+                f4(0, 0, 0)
+                f4(0, 0, 0)
+
+    u4(3)
+    for i in range(3):
+        text("枠%d" % i)
+        text("frame%d" % i)
+        u1(1 if i == 0 else 0)
+        u4(5)
+        for e in range(5):
+            u1(e % 2)
+            idx(e, bis if e % 2 == 0 else mois)
+
+    rigid = 20
+    u4(rigid)
+    for i in range(rigid):
+        text("剛体%d" % i)
+        text("rigid%d" % i)
+        idx(i % a.bones, bis)
+        u1(0)
+        u2(0xFFFF)
+        u1(i % 3)
+        f4(1, 1, 1)
+        f4(0, i, 0)
+        f4(0, 0, 0)
+        f4(1, 0.5, 0.5, 0, 0.5)
+        u1(i % 3)
+
+    u4(10)
+    for i in range(10):
+        text("ジョイント%d" % i)
+        text("joint%d" % i)
+        u1(0)
+        idx(i, ris)
+        idx(i + 1, ris)
+        for _ in range(8):
+            f4(0, 0, 0)
+
+    with open(a.output, "wb") as f:
+        f.write(out)
+
+
+if __name__ == "__main__":
+    main()
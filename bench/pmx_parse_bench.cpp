@@ -0,0 +1,87 @@
+/*************************************************************************/
+/*  pmx_parse_bench.cpp                                                  */
+/*************************************************************************/
+/*                                                                       */
+/*  Standalone benchmark for the PMX parser. It does not depend on Godot */
+/*  and is not part of the module build. From the module directory:      */
+/*                                                                       */
+/*    K=thirdparty/kaitai_struct_cpp_stl_runtime                         */
+/*    g++ -O2 -std=c++14 -DKS_STR_ENCODING_ICONV -I$K -Ithirdparty/ksy \ */
+/*        bench/pmx_parse_bench.cpp thirdparty/ksy/mmd_pmx.cpp \         */
+/*        $K/kaitai/kaitaistream.cpp $K/kaitai/kaitaistruct.cpp \        */
+/*        -o pmx_parse_bench                                             */
+/*    ./pmx_parse_bench model.pmx [iterations]                           */
+/*                                                                       */
+/*  bench/make_synthetic_pmx.py writes a large test model when no real   */
+/*  one is at hand.                                                      */
+/*************************************************************************/
+
+#include "mmd_pmx.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+typedef std::chrono::steady_clock bench_clock;
+
+static double elapsed_ms(bench_clock::time_point p_start) {
+	return std::chrono::duration<double, std::milli>(bench_clock::now() - p_start).count();
+}
+
+// The path the importer used originally: every field is read through
+// std::ifstream.
+static double parse_ifstream(const char *p_path) {
+	bench_clock::time_point start = bench_clock::now();
+	std::ifstream ifs(p_path, std::ifstream::binary);
+	kaitai::kstream ks(&ifs);
+	mmd_pmx_t pmx(&ks);
+	return elapsed_ms(start);
+}
+
+// The path the importer uses now: the file is read into memory once and
+// parsed from the buffer. The file read is included in the timing.
+static double parse_buffer(const char *p_path) {
+	bench_clock::time_point start = bench_clock::now();
+	std::ifstream ifs(p_path, std::ifstream::binary);
+	std::vector<char> data((std::istreambuf_iterator<char>(ifs)), std::istreambuf_iterator<char>());
+	kaitai::kstream ks(data.data(), data.size());
+	mmd_pmx_t pmx(&ks);
+	return elapsed_ms(start);
+}
+
+static void report(const char *p_name, std::vector<double> &r_samples) {
+	std::sort(r_samples.begin(), r_samples.end());
+	printf("%-10s min %8.2f ms  median %8.2f ms\n", p_name, r_samples.front(), r_samples[r_samples.size() / 2]);
+}
+
+int main(int argc, char **argv) {
+	if (argc < 2) {
+		fprintf(stderr, "usage: %s model.pmx [iterations]\n", argv[0]);
+		return 1;
+	}
+	int iterations = argc > 2 ? atoi(argv[2]) : 10;
+	if (iterations < 1) {
+		iterations = 1;
+	}
+	std::vector<double> ifstream_samples;
+	std::vector<double> buffer_samples;
+	try {
+		// Warm the page cache so both readers see the same I/O cost.
+		parse_buffer(argv[1]);
+		for (int i = 0; i < iterations; i++) {
+			ifstream_samples.push_back(parse_ifstream(argv[1]));
+			buffer_samples.push_back(parse_buffer(argv[1]));
+		}
+	} catch (const std::exception &e) {
+		fprintf(stderr, "failed to parse %s: %s\n", argv[1], e.what());
+		return 1;
+	}
+	report("ifstream", ifstream_samples);
+	report("buffer", buffer_samples);
+	return 0;
+}
@@ -29,9 +29,16 @@
 /*************************************************************************/
 
 #include "editor_scene_importer_mmd_pmx.h"
+#include "pmx_mesh_simplifier.h"
 
 #include "thirdparty/ksy/mmd_pmx.h"
 
+#include "core/io/dir_access.h"
+#include "core/io/file_access.h"
+#include "core/io/image.h"
+#include "core/io/resource_loader.h"
+#include "core/os/os.h"
+#include "core/templates/thread_work_pool.h"
 #include "editor/import/scene_importer_mesh_node_3d.h"
 #include "scene/3d/mesh_instance_3d.h"
 #include "scene/3d/node_3d.h"
@@ -42,9 +49,63 @@
 #include <unistd.h>
 
 #include <cstdint>
-#include <fstream>
 #include <string>
 
+#ifdef TOOLS_ENABLED
+#include "editor/editor_node.h"
+#endif
+
+// Bytes the rendering server stores per surface vertex: a float position,
+// packed normal, float UV, and 16-bit bones and weights.
+static const uint64_t PMX_VERTEX_STRIDE = 12 + 4 + 8 + 8 + 8;
+
+// Reports import stages through EditorProgress when running inside the
+// editor, and remembers whether the user pressed cancel. Progress is on a
+// 0-100 scale; each stage owns a slice of it.
+struct PackedSceneMMDPMX::ImportProgress {
+	enum {
+		PARSE_END = 40,
+		SURFACES_END = 75,
+		TEXTURES_END = 95,
+		STEPS = 100,
+	};
+
+#ifdef TOOLS_ENABLED
+	EditorProgress *progress = nullptr;
+#endif
+	bool cancelled = false;
+
+	ImportProgress(const String &p_path) {
+#ifdef TOOLS_ENABLED
+		if (EditorNode::get_singleton()) {
+			progress = memnew(EditorProgress("import_pmx", vformat(TTR("Importing %s"), p_path.get_file()), STEPS, true));
+		}
+#endif
+	}
+
+	~ImportProgress() {
+#ifdef TOOLS_ENABLED
+		if (progress) {
+			memdelete(progress);
+		}
+#endif
+	}
+
+	// Moves to p_done of p_total within [p_from, p_to). Returns true once the
+	// import has been cancelled.
+	bool step(const String &p_state, int32_t p_from, int32_t p_to, uint32_t p_done, uint32_t p_total) {
+#ifdef TOOLS_ENABLED
+		if (progress && !cancelled) {
+			int32_t value = p_from + (p_total ? (int32_t)((int64_t)(p_to - p_from) * p_done / p_total) : 0);
+			// Callers poll every millisecond; without forcing, the dialog
+			// redraws at its own rate.
+			cancelled = progress->step(p_state, value, false);
+		}
+#endif
+		return cancelled;
+	}
+};
+
 uint32_t EditorSceneImporterMMDPMX::get_import_flags() const {
 	return ImportFlags::IMPORT_SCENE;
 }
@@ -68,11 +129,160 @@ Ref<Animation> EditorSceneImporterMMDPMX::import_animation(const String &p_path,
 	return Ref<Animation>();
 }
 
+void PMXMMDState::_bind_methods() {
+	ClassDB::bind_method(D_METHOD("set_import_sections", "import_sections"), &PMXMMDState::set_import_sections);
+	ClassDB::bind_method(D_METHOD("get_import_sections"), &PMXMMDState::get_import_sections);
+	ClassDB::bind_method(D_METHOD("set_model_name", "model_name"), &PMXMMDState::set_model_name);
+	ClassDB::bind_method(D_METHOD("get_model_name"), &PMXMMDState::get_model_name);
+	ClassDB::bind_method(D_METHOD("set_materials", "materials"), &PMXMMDState::set_materials);
+	ClassDB::bind_method(D_METHOD("get_materials"), &PMXMMDState::get_materials);
+	ClassDB::bind_method(D_METHOD("set_deduplicate_materials", "deduplicate_materials"), &PMXMMDState::set_deduplicate_materials);
+	ClassDB::bind_method(D_METHOD("get_deduplicate_materials"), &PMXMMDState::get_deduplicate_materials);
+	ClassDB::bind_method(D_METHOD("set_atlas_textures", "atlas_textures"), &PMXMMDState::set_atlas_textures);
+	ClassDB::bind_method(D_METHOD("get_atlas_textures"), &PMXMMDState::get_atlas_textures);
+	ClassDB::bind_method(D_METHOD("set_single_mesh", "single_mesh"), &PMXMMDState::set_single_mesh);
+	ClassDB::bind_method(D_METHOD("get_single_mesh"), &PMXMMDState::get_single_mesh);
+	ClassDB::bind_method(D_METHOD("set_weld_vertices", "weld_vertices"), &PMXMMDState::set_weld_vertices);
+	ClassDB::bind_method(D_METHOD("get_weld_vertices"), &PMXMMDState::get_weld_vertices);
+	ClassDB::bind_method(D_METHOD("set_quantize_attributes", "quantize_attributes"), &PMXMMDState::set_quantize_attributes);
+	ClassDB::bind_method(D_METHOD("get_quantize_attributes"), &PMXMMDState::get_quantize_attributes);
+	ClassDB::bind_method(D_METHOD("set_optimize_vertex_cache", "optimize_vertex_cache"), &PMXMMDState::set_optimize_vertex_cache);
+	ClassDB::bind_method(D_METHOD("get_optimize_vertex_cache"), &PMXMMDState::get_optimize_vertex_cache);
+	ClassDB::bind_method(D_METHOD("set_lod_errors", "lod_errors"), &PMXMMDState::set_lod_errors);
+	ClassDB::bind_method(D_METHOD("get_lod_errors"), &PMXMMDState::get_lod_errors);
+	ClassDB::bind_method(D_METHOD("set_cache_textures", "cache_textures"), &PMXMMDState::set_cache_textures);
+	ClassDB::bind_method(D_METHOD("get_cache_textures"), &PMXMMDState::get_cache_textures);
+	ClassDB::bind_method(D_METHOD("set_statistics", "statistics"), &PMXMMDState::set_statistics);
+	ClassDB::bind_method(D_METHOD("get_statistics"), &PMXMMDState::get_statistics);
+
+	ADD_PROPERTY(PropertyInfo(Variant::INT, "import_sections", PROPERTY_HINT_FLAGS, "Metadata,Geometry,Skeleton,Morphs,Display Frames,Physics"), "set_import_sections", "get_import_sections");
+	ADD_PROPERTY(PropertyInfo(Variant::STRING, "model_name"), "set_model_name", "get_model_name");
+	ADD_PROPERTY(PropertyInfo(Variant::ARRAY, "materials"), "set_materials", "get_materials");
+	ADD_PROPERTY(PropertyInfo(Variant::BOOL, "deduplicate_materials"), "set_deduplicate_materials", "get_deduplicate_materials");
+	ADD_PROPERTY(PropertyInfo(Variant::BOOL, "atlas_textures"), "set_atlas_textures", "get_atlas_textures");
+	ADD_PROPERTY(PropertyInfo(Variant::BOOL, "single_mesh"), "set_single_mesh", "get_single_mesh");
+	ADD_PROPERTY(PropertyInfo(Variant::BOOL, "weld_vertices"), "set_weld_vertices", "get_weld_vertices");
+	ADD_PROPERTY(PropertyInfo(Variant::BOOL, "quantize_attributes"), "set_quantize_attributes", "get_quantize_attributes");
+	ADD_PROPERTY(PropertyInfo(Variant::BOOL, "optimize_vertex_cache"), "set_optimize_vertex_cache", "get_optimize_vertex_cache");
+	ADD_PROPERTY(PropertyInfo(Variant::PACKED_FLOAT32_ARRAY, "lod_errors"), "set_lod_errors", "get_lod_errors");
+	ADD_PROPERTY(PropertyInfo(Variant::BOOL, "cache_textures"), "set_cache_textures", "get_cache_textures");
+	ADD_PROPERTY(PropertyInfo(Variant::DICTIONARY, "statistics"), "set_statistics", "get_statistics");
+
+	BIND_ENUM_CONSTANT(IMPORT_SECTION_METADATA);
+	BIND_ENUM_CONSTANT(IMPORT_SECTION_GEOMETRY);
+	BIND_ENUM_CONSTANT(IMPORT_SECTION_SKELETON);
+	BIND_ENUM_CONSTANT(IMPORT_SECTION_MORPHS);
+	BIND_ENUM_CONSTANT(IMPORT_SECTION_DISPLAY_FRAMES);
+	BIND_ENUM_CONSTANT(IMPORT_SECTION_PHYSICS);
+	BIND_ENUM_CONSTANT(IMPORT_SECTION_ALL);
+	BIND_ENUM_CONSTANT(IMPORT_SECTION_DEFAULT);
+}
+
+void PMXMMDState::set_import_sections(int32_t p_import_sections) {
+	import_sections = p_import_sections;
+}
+
+int32_t PMXMMDState::get_import_sections() const {
+	return import_sections;
+}
+
+void PMXMMDState::set_model_name(const String &p_model_name) {
+	model_name = p_model_name;
+}
+
+String PMXMMDState::get_model_name() const {
+	return model_name;
+}
+
+void PMXMMDState::set_materials(const Array &p_materials) {
+	materials = p_materials;
+}
+
+Array PMXMMDState::get_materials() const {
+	return materials;
+}
+
+void PMXMMDState::set_deduplicate_materials(bool p_deduplicate_materials) {
+	deduplicate_materials = p_deduplicate_materials;
+}
+
+bool PMXMMDState::get_deduplicate_materials() const {
+	return deduplicate_materials;
+}
+
+void PMXMMDState::set_atlas_textures(bool p_atlas_textures) {
+	atlas_textures = p_atlas_textures;
+}
+
+bool PMXMMDState::get_atlas_textures() const {
+	return atlas_textures;
+}
+
+void PMXMMDState::set_single_mesh(bool p_single_mesh) {
+	single_mesh = p_single_mesh;
+}
+
+bool PMXMMDState::get_single_mesh() const {
+	return single_mesh;
+}
+
+void PMXMMDState::set_weld_vertices(bool p_weld_vertices) {
+	weld_vertices = p_weld_vertices;
+}
+
+bool PMXMMDState::get_weld_vertices() const {
+	return weld_vertices;
+}
+
+void PMXMMDState::set_quantize_attributes(bool p_quantize_attributes) {
+	quantize_attributes = p_quantize_attributes;
+}
+
+bool PMXMMDState::get_quantize_attributes() const {
+	return quantize_attributes;
+}
+
+void PMXMMDState::set_optimize_vertex_cache(bool p_optimize_vertex_cache) {
+	optimize_vertex_cache = p_optimize_vertex_cache;
+}
+
+bool PMXMMDState::get_optimize_vertex_cache() const {
+	return optimize_vertex_cache;
+}
+
+void PMXMMDState::set_lod_errors(const PackedFloat32Array &p_lod_errors) {
+	lod_errors = p_lod_errors;
+}
+
+PackedFloat32Array PMXMMDState::get_lod_errors() const {
+	return lod_errors;
+}
+
+void PMXMMDState::set_cache_textures(bool p_cache_textures) {
+	cache_textures = p_cache_textures;
+}
+
+bool PMXMMDState::get_cache_textures() const {
+	return cache_textures;
+}
+
+void PMXMMDState::set_statistics(const Dictionary &p_statistics) {
+	statistics = p_statistics;
+}
+
+Dictionary PMXMMDState::get_statistics() const {
+	return statistics;
+}
+
+Mutex PackedSceneMMDPMX::texture_cache_mutex;
+HashMap<String, PackedSceneMMDPMX::CachedTexture> PackedSceneMMDPMX::texture_cache;
+
 void PackedSceneMMDPMX::_bind_methods() {
 	ClassDB::bind_method(D_METHOD("pack_mmd_pmx", "path", "flags", "bake_fps", "state"),
 			&PackedSceneMMDPMX::pack_mmd_pmx, DEFVAL(0), DEFVAL(1000.0f), DEFVAL(Ref<PMXMMDState>()));
 	ClassDB::bind_method(D_METHOD("import_mmd_pmx_scene", "path", "flags", "bake_fps", "state"),
 			&PackedSceneMMDPMX::import_mmd_pmx_scene, DEFVAL(0), DEFVAL(1000.0f), DEFVAL(Ref<PMXMMDState>()));
+	ClassDB::bind_static_method("PackedSceneMMDPMX", D_METHOD("clear_texture_cache"), &PackedSceneMMDPMX::clear_texture_cache);
 }
 Node *PackedSceneMMDPMX::import_mmd_pmx_scene(const String &p_path, uint32_t p_flags, float p_bake_fps, Ref<PMXMMDState> r_state) {
 	Error err = FAILED;
@@ -88,241 +298,1186 @@ Node *PackedSceneMMDPMX::import_scene(const String &p_path, uint32_t p_flags,
 	if (r_state == Ref<PMXMMDState>()) {
 		r_state.instantiate();
 	}
-	std::ifstream ifs(
-			ProjectSettings::get_singleton()->globalize_path(p_path).utf8().get_data(), std::ifstream::binary);
-	kaitai::kstream ks(&ifs);
-	mmd_pmx_t pmx = mmd_pmx_t(&ks);
+	r_state->set_statistics(Dictionary());
+	// Read the whole file once and let kaitai decode straight from memory,
+	// rather than going through std::istream for every field.
+	Error err = OK;
+	Vector<uint8_t> pmx_data = FileAccess::get_file_as_array(p_path, &err);
+	if (r_err) {
+		*r_err = err;
+	}
+	ERR_FAIL_COND_V_MSG(err != OK, nullptr, "Cannot open PMX file: " + p_path + ".");
+	kaitai::kstream ks(reinterpret_cast<const char *>(pmx_data.ptr()), pmx_data.size());
+	int32_t import_sections = r_state->get_import_sections();
+	if (import_sections & PMXMMDState::IMPORT_SECTION_GEOMETRY) {
+		// Surfaces are cut out of the face list by material.
+		import_sections |= PMXMMDState::IMPORT_SECTION_METADATA;
+	}
+	uint32_t section_mask = _get_pmx_section_mask(import_sections);
+	// Check every count and index the import will rely on before anything
+	// is allocated for it, so a truncated or hostile file fails cleanly.
+	uint64_t error_offset = 0;
+	const char *error = nullptr;
+	if (!mmd_pmx_t::validate(reinterpret_cast<const char *>(pmx_data.ptr()), pmx_data.size(), section_mask, &error_offset, &error)) {
+		if (r_err) {
+			*r_err = ERR_FILE_CORRUPT;
+		}
+		ERR_FAIL_V_MSG(nullptr, vformat("Invalid PMX file %s at byte %d: %s.", p_path, error_offset, error));
+	}
+	// Locate the requested sections up front, then decode them concurrently.
+	// The vertex section is further split into fixed-size chunks, since it
+	// and the morphs dominate on large models.
+	ImportProgress progress(p_path);
+	std::unique_ptr<mmd_pmx_t> pmx;
+	try {
+		pmx.reset(new mmd_pmx_t(&ks, mmd_pmx_t::READ_MODE_DEFERRED, section_mask));
+	} catch (const std::exception &e) {
+		if (r_err) {
+			*r_err = ERR_FILE_CORRUPT;
+		}
+		ERR_FAIL_V_MSG(nullptr, "Cannot parse PMX file: " + p_path + ": " + e.what() + ".");
+	}
+	PMXSectionRead section_read;
+	section_read.pmx = pmx.get();
+	for (int32_t section_i = mmd_pmx_t::SECTION_VERTICES + 1; section_i < mmd_pmx_t::SECTION_COUNT; section_i++) {
+		if (section_mask & (1u << section_i)) {
+			section_read.sections.push_back(mmd_pmx_t::section_t(section_i));
+		}
+	}
+	uint32_t vertex_chunk_count = 0;
+	if (section_mask & (1u << mmd_pmx_t::SECTION_VERTICES)) {
+		vertex_chunk_count = pmx->begin_vertex_chunks();
+	}
+	section_read.errors.resize(section_read.sections.size() + vertex_chunk_count);
+	ThreadWorkPool section_pool;
+	section_pool.init();
+	section_pool.begin_work(section_read.errors.size(), this, &PackedSceneMMDPMX::_read_pmx_section, &section_read);
+	while (!section_pool.is_done_dispatching()) {
+		// Jobs that have not started yet return at once after a cancel.
+		if (progress.step(TTR("Parsing"), 0, ImportProgress::PARSE_END, section_pool.get_work_index(), section_read.errors.size())) {
+			section_read.cancelled.set();
+		}
+		OS::get_singleton()->delay_usec(1000);
+	}
+	section_pool.end_work();
+	section_pool.finish();
+	if (section_read.cancelled.is_set()) {
+		if (r_err) {
+			*r_err = ERR_SKIP;
+		}
+		return nullptr;
+	}
+	for (uint32_t job_i = 0; job_i < section_read.errors.size(); job_i++) {
+		if (!section_read.errors[job_i].is_empty()) {
+			if (r_err) {
+				*r_err = ERR_FILE_CORRUPT;
+			}
+			ERR_FAIL_V_MSG(nullptr, "Cannot parse PMX file: " + p_path + ": " + section_read.errors[job_i] + ".");
+		}
+	}
+	pmx->end_vertex_chunks();
 	Node3D *root = memnew(Node3D);
+	r_state->set_model_name(pick_universal_or_common(pmx->header()->english_model_name(), pmx->header()->model_name()));
 
-	std::vector<std::unique_ptr<mmd_pmx_t::material_t> > *materials = pmx.materials();
-	struct MMDMaterialVertexCounts {
-		uint32_t start = 0;
-		uint32_t end = 0;
-	};
-	Vector<MMDMaterialVertexCounts> material_index_counts;
-	material_index_counts.resize(pmx.material_count());
-	for (uint32_t material_i = 0; material_i < pmx.material_count(); material_i++) {
-		if (material_i != 0) {
-			material_index_counts.write[material_i].start = material_index_counts[material_i - 1].end;
+	// Textures load on the resource loader's threads while the meshes are
+	// built; they are bound to the materials, which the surfaces already
+	// reference, once the meshes are done.
+	Array materials;
+	PMXTextureLoad texture_load;
+	bool textures_bound = false;
+	// Atlasing appends vertices; index savings are measured against the
+	// model as loaded.
+	const uint32_t model_vertex_count = pmx->vertex_count();
+	if (import_sections & PMXMMDState::IMPORT_SECTION_METADATA) {
+		_request_textures(pmx.get(), p_path, r_state->get_cache_textures(), texture_load);
+		Dictionary statistics = r_state->get_statistics();
+		statistics["textures_resolved"] = texture_load.resolved_names;
+		statistics["textures_unresolved"] = texture_load.unresolved_names.size();
+		r_state->set_statistics(statistics);
+		print_verbose(vformat("PMX: resolved %d texture names, %d unresolved.", texture_load.resolved_names, texture_load.unresolved_names.size()));
+		if (r_missing_deps) {
+			for (uint32_t name_i = 0; name_i < texture_load.unresolved_names.size(); name_i++) {
+				r_missing_deps->push_back(texture_load.unresolved_names[name_i]);
+			}
+		}
+		for (uint32_t material_i = 0; material_i < pmx->material_count(); material_i++) {
+			materials.push_back(_create_material(pmx.get(), material_i));
+		}
+		if (r_state->get_deduplicate_materials()) {
+			uint32_t merged = _deduplicate_materials(pmx.get(), texture_load, materials);
+			Dictionary statistics = r_state->get_statistics();
+			statistics["deduplicated_materials"] = merged;
+			r_state->set_statistics(statistics);
+			print_verbose(vformat("PMX: merged %d duplicate materials.", merged));
+		}
+		if ((import_sections & PMXMMDState::IMPORT_SECTION_GEOMETRY) && r_state->get_atlas_textures()) {
+			// The atlas needs the texture images before surfaces are cut, so
+			// this gives up overlapping the loads with mesh building.
+			_finish_textures(texture_load, &progress);
+			_bind_textures(pmx.get(), materials, texture_load.textures);
+			textures_bound = true;
+			if (!progress.cancelled) {
+				uint32_t saved = _atlas_materials(pmx.get(), materials, texture_load.textures);
+				Dictionary statistics = r_state->get_statistics();
+				statistics["atlas_draw_calls_saved"] = saved;
+				r_state->set_statistics(statistics);
+				print_verbose(vformat("PMX: texture atlasing saved %d draw calls.", saved));
+			}
+		}
+	}
+	r_state->set_materials(materials);
+	if ((import_sections & PMXMMDState::IMPORT_SECTION_GEOMETRY) && !progress.cancelled) {
+		if (r_state->get_quantize_attributes()) {
+			_quantize_attributes(pmx.get());
+		}
+		_create_meshes(pmx.get(), model_vertex_count, r_state, root, &progress);
+	}
+	if ((import_sections & PMXMMDState::IMPORT_SECTION_METADATA) && !textures_bound) {
+		_finish_textures(texture_load, &progress);
+		_bind_textures(pmx.get(), materials, texture_load.textures);
+	}
+	if ((import_sections & PMXMMDState::IMPORT_SECTION_PHYSICS) && !progress.step(TTR("Creating physics"), ImportProgress::TEXTURES_END, ImportProgress::STEPS, 0, 1)) {
+		std::vector<std::unique_ptr<mmd_pmx_t::rigid_body_t> > *rigid_bodies = pmx->rigid_bodies();
+		for (uint32_t rigid_bodies_i = 0; rigid_bodies_i < pmx->rigid_body_count(); rigid_bodies_i++) {
+			RigidBody3D *rigid_3d = memnew(RigidBody3D);
+			String rigid_name = pick_universal_or_common(rigid_bodies->at(rigid_bodies_i)->english_name(),
+					rigid_bodies->at(rigid_bodies_i)->name());
+			rigid_3d->set_name(rigid_name);
+			root->add_child(rigid_3d);
+			rigid_3d->set_owner(root);
+		}
+	}
+	if (progress.cancelled) {
+		memdelete(root);
+		if (r_err) {
+			*r_err = ERR_SKIP;
+		}
+		return nullptr;
+	}
+	return root;
+}
+
+uint32_t PackedSceneMMDPMX::_get_pmx_section_mask(int32_t p_import_sections) {
+	uint32_t mask = 0;
+	if (p_import_sections & PMXMMDState::IMPORT_SECTION_METADATA) {
+		mask |= (1u << mmd_pmx_t::SECTION_TEXTURES) | (1u << mmd_pmx_t::SECTION_MATERIALS);
+	}
+	if (p_import_sections & PMXMMDState::IMPORT_SECTION_GEOMETRY) {
+		mask |= (1u << mmd_pmx_t::SECTION_VERTICES) | (1u << mmd_pmx_t::SECTION_FACES);
+	}
+	if (p_import_sections & PMXMMDState::IMPORT_SECTION_SKELETON) {
+		mask |= 1u << mmd_pmx_t::SECTION_BONES;
+	}
+	if (p_import_sections & PMXMMDState::IMPORT_SECTION_MORPHS) {
+		mask |= 1u << mmd_pmx_t::SECTION_MORPHS;
+	}
+	if (p_import_sections & PMXMMDState::IMPORT_SECTION_DISPLAY_FRAMES) {
+		mask |= 1u << mmd_pmx_t::SECTION_FRAMES;
+	}
+	if (p_import_sections & PMXMMDState::IMPORT_SECTION_PHYSICS) {
+		mask |= (1u << mmd_pmx_t::SECTION_RIGID_BODIES) | (1u << mmd_pmx_t::SECTION_JOINTS);
+	}
+	return mask;
+}
+
+// PMX texture names come from Windows tools: any casing, backslashes, and,
+// from Shift_JIS software, yen signs or fullwidth forms in place of ASCII.
+// Names and files on disk are compared by this key.
+static String _get_texture_key(const String &p_name) {
+	String key = p_name;
+	for (int32_t char_i = 0; char_i < key.length(); char_i++) {
+		const char32_t c = key[char_i];
+		if (c == '\\' || c == 0x00A5 || c == 0xFF3C) {
+			key[char_i] = '/';
+		} else if (c >= 0xFF01 && c <= 0xFF5E) {
+			key[char_i] = (char32_t)(c - 0xFEE0);
+		}
+	}
+	return key.to_lower().simplify_path();
+}
+
+// Deep enough for any model's texture folders without walking a whole
+// project when a model sits near its root.
+static const int32_t PMX_TEXTURE_INDEX_MAX_DEPTH = 8;
+
+static void _index_texture_directory(const String &p_dir, const String &p_key_prefix, int32_t p_depth, HashMap<String, String> &r_index) {
+	DirAccessRef dir = DirAccess::open(p_dir);
+	if (!dir) {
+		return;
+	}
+	dir->list_dir_begin();
+	for (String name = dir->get_next(); !name.is_empty(); name = dir->get_next()) {
+		// Skips navigation and hidden entries such as .import.
+		if (name.begins_with(".")) {
+			continue;
+		}
+		const String key = p_key_prefix + _get_texture_key(name);
+		if (dir->current_is_dir()) {
+			if (p_depth < PMX_TEXTURE_INDEX_MAX_DEPTH) {
+				_index_texture_directory(p_dir.plus_file(name), key + "/", p_depth + 1, r_index);
+			}
+		} else if (!r_index.has(key)) {
+			r_index.set(key, p_dir.plus_file(name));
+		}
+	}
+	dir->list_dir_end();
+}
+
+void PackedSceneMMDPMX::_request_textures(const mmd_pmx_t *p_pmx, const String &p_path, bool p_use_cache, PMXTextureLoad &r_load) {
+	// Each texture entry is resolved once, however many materials use it,
+	// and each distinct path is requested once, however many entries name
+	// it.
+	const String base_dir = p_path.get_base_dir();
+	HashMap<String, int32_t> request_indices;
+	HashMap<String, int32_t> first_entries;
+	// The model directory is scanned once, so each name resolves with one
+	// lookup whatever its casing and separators.
+	HashMap<String, String> directory_index;
+	if (p_pmx->texture_count()) {
+		_index_texture_directory(base_dir, String(), 0, directory_index);
+	}
+	r_load.use_cache = p_use_cache;
+	r_load.textures.resize(p_pmx->texture_count());
+	r_load.entry_requests.resize(p_pmx->texture_count());
+	r_load.entry_sources.resize(p_pmx->texture_count());
+	for (uint32_t texture_i = 0; texture_i < p_pmx->texture_count(); texture_i++) {
+		r_load.entry_requests[texture_i] = -1;
+		r_load.entry_sources[texture_i] = -1;
+		const String texture_name = convert_string(p_pmx->textures()->at(texture_i)->name());
+		if (texture_name.is_empty()) {
+			continue;
+		}
+		const String *indexed_path = directory_index.getptr(_get_texture_key(texture_name));
+		String texture_path;
+		if (indexed_path) {
+			texture_path = *indexed_path;
+		} else {
+			// Names reaching outside the model directory are not indexed.
+			texture_path = base_dir.plus_file(texture_name.replace("\\", "/")).simplify_path();
+			if (!FileAccess::exists(texture_path)) {
+				r_load.unresolved_names.push_back(texture_name);
+				continue;
+			}
+		}
+		r_load.resolved_names++;
+		const int32_t *first_entry = first_entries.getptr(texture_path);
+		if (first_entry) {
+			r_load.entry_sources[texture_i] = *first_entry;
 		} else {
-			material_index_counts.write[material_i].start = 0;
-		}
-		uint32_t start = material_index_counts[material_i].start;
-		uint32_t count = materials->at(material_i)->face_vertex_count();
-		material_index_counts.write[material_i].end = start + count;
-	}
-	for (int32_t material_i = 0; material_i < material_index_counts.size(); material_i++) {
-		Ref<SurfaceTool> surface;
-		surface.instantiate();
-		surface->begin(Mesh::PRIMITIVE_TRIANGLES);
-		std::vector<std::unique_ptr<mmd_pmx_t::vertex_t> > *vertices = pmx.vertices();
-		for (uint32_t vertex_i = 0; vertex_i < pmx.vertex_count(); vertex_i++) {
-			real_t x = vertices->at(vertex_i)->normal()->x();
-			real_t y = vertices->at(vertex_i)->normal()->y();
-			real_t z = vertices->at(vertex_i)->normal()->z();
-			Vector3 normal = Vector3(x, y, z);
-			surface->set_normal(normal);
-			x = vertices->at(vertex_i)->uv()->x();
-			y = vertices->at(vertex_i)->uv()->y();
-			z = 0.0f;
-			Vector2 uv = Vector2(x, y);
-			surface->set_uv(uv);
-			x = vertices->at(vertex_i)->position()->x();
-			x *= mmd_unit_conversion;
-			y = vertices->at(vertex_i)->position()->y();
-			y *= mmd_unit_conversion;
-			z = vertices->at(vertex_i)->position()->z();
-			z *= mmd_unit_conversion;
-			Vector3 point = Vector3(x, y, z);
-			PackedInt32Array bones;
-			bones.push_back(0);
-			bones.push_back(0);
-			bones.push_back(0);
-			bones.push_back(0);
-			PackedFloat32Array weights;
-			weights.push_back(0.0f);
-			weights.push_back(0.0f);
-			weights.push_back(0.0f);
-			weights.push_back(0.0f);
-			if (!vertices->at(vertex_i)->_is_null_skin_weights()) {
-				mmd_pmx_t::bone_type_t bone_type = vertices->at(vertex_i)->type();
-				switch (bone_type) {
-					case mmd_pmx_t::BONE_TYPE_BDEF1: {
-						mmd_pmx_t::bdef1_weights_t *pmx_weights = (mmd_pmx_t::bdef1_weights_t *)vertices->at(vertex_i)->skin_weights();
-						int64_t bone_index = pmx_weights->bone_index()->value();
-						switch (pmx_weights->bone_index()->size()) {
-							case 1: {
-								if (bone_index != UINT8_MAX) {
-									bones.write[0] = bone_index;
-									weights.write[0] = 1.0f;
-								}
-							} break;
-							case 2: {
-								if (bone_index != UINT16_MAX) {
-									bones.write[0] = bone_index;
-									weights.write[0] = 1.0f;
-								}
-							} break;
-							case 4: {
-								if (bone_index != UINT32_MAX) {
-									bones.write[0] = bone_index;
-									weights.write[0] = 1.0f;
-								}
-							} break;
-							default:
-								break;
-								// nothing
-						}
-					} break;
-					case mmd_pmx_t::BONE_TYPE_BDEF2: {
-						mmd_pmx_t::bdef2_weights_t *pmx_weights = (mmd_pmx_t::bdef2_weights_t *)vertices->at(vertex_i)->skin_weights();
-						for (int32_t count = 0; count < 2; count++) {
-							int64_t bone_index = pmx_weights->bone_indices()->at(count)->value();
-							switch (pmx_weights->bone_indices()->at(count)->size()) {
-								case 1: {
-									if (bone_index != UINT8_MAX) {
-										bones.write[count] = bone_index;
-										weights.write[count] = pmx_weights->weights()->at(count);
-									}
-								} break;
-								case 2: {
-									if (bone_index != UINT16_MAX) {
-										bones.write[count] = bone_index;
-										weights.write[count] = pmx_weights->weights()->at(count);
-									}
-								} break;
-								case 4: {
-									if (bone_index != UINT32_MAX) {
-										bones.write[count] = bone_index;
-										weights.write[count] = pmx_weights->weights()->at(count);
-									}
-								} break;
-								default:
-									break;
-									// nothing
-							}
-						}
-					} break;
-					case mmd_pmx_t::BONE_TYPE_BDEF4: {
-						mmd_pmx_t::bdef4_weights_t *pmx_weights = (mmd_pmx_t::bdef4_weights_t *)vertices->at(vertex_i)->skin_weights();
-						for (int32_t count = 0; count < RS::ARRAY_WEIGHTS_SIZE; count++) {
-							switch (pmx_weights->bone_indices()->at(count)->size()) {
-								case 1: {
-									uint8_t bone_index = pmx_weights->bone_indices()->at(count)->value();
-									if (bone_index != UINT8_MAX) {
-										bones.write[count] = bone_index;
-										weights.write[count] = pmx_weights->weights()->at(count);
-									}
-								} break;
-								case 2: {
-									uint16_t bone_index = pmx_weights->bone_indices()->at(count)->value();
-									if (bone_index != UINT16_MAX) {
-										bones.write[count] = bone_index;
-										weights.write[count] = pmx_weights->weights()->at(count);
-									}
-								} break;
-								case 4: {
-									uint32_t bone_index = pmx_weights->bone_indices()->at(count)->value();
-									if (bone_index != UINT32_MAX) {
-										bones.write[count] = bone_index;
-										weights.write[count] = pmx_weights->weights()->at(count);
-									}
-								} break;
-								default:
-									break;
-									// nothing
-							}
-						}
-					} break;
-					case mmd_pmx_t::BONE_TYPE_SDEF: {
-					} break;
-					case mmd_pmx_t::BONE_TYPE_QDEF: {
-					} break;
-					default:
-						break;
-						// nothing
+			first_entries.set(texture_path, texture_i);
+			r_load.entry_sources[texture_i] = texture_i;
+		}
+		const int32_t *requested = request_indices.getptr(texture_path);
+		if (requested) {
+			r_load.entry_requests[texture_i] = *requested;
+			continue;
+		}
+		// Cache entries are checked against the file's modification time,
+		// so an edited texture is loaded again.
+		const uint64_t modified_time = p_use_cache ? FileAccess::get_modified_time(texture_path) : 0;
+		if (p_use_cache) {
+			MutexLock lock(texture_cache_mutex);
+			const CachedTexture *cached = texture_cache.getptr(texture_path);
+			if (cached && cached->modified_time == modified_time) {
+				r_load.textures[texture_i] = cached->texture;
+				continue;
+			}
+		}
+		if (ResourceLoader::load_threaded_request(texture_path) != OK) {
+			continue;
+		}
+		request_indices.set(texture_path, r_load.request_paths.size());
+		r_load.entry_requests[texture_i] = r_load.request_paths.size();
+		r_load.request_paths.push_back(texture_path);
+		r_load.request_modified_times.push_back(modified_time);
+	}
+}
+
+void PackedSceneMMDPMX::_finish_textures(PMXTextureLoad &r_load, ImportProgress *p_progress) {
+	LocalVector<Ref<Texture> > loaded;
+	loaded.resize(r_load.request_paths.size());
+	for (uint32_t request_i = 0; request_i < r_load.request_paths.size(); request_i++) {
+		// Every request is collected, even after a cancel, so none is left
+		// behind in the loader.
+		while (!p_progress->cancelled && ResourceLoader::load_threaded_get_status(r_load.request_paths[request_i]) == ResourceLoader::THREAD_LOAD_IN_PROGRESS) {
+			p_progress->step(TTR("Loading textures"), ImportProgress::SURFACES_END, ImportProgress::TEXTURES_END, request_i, r_load.request_paths.size());
+			OS::get_singleton()->delay_usec(1000);
+		}
+		loaded[request_i] = ResourceLoader::load_threaded_get(r_load.request_paths[request_i]);
+		if (r_load.use_cache && loaded[request_i].is_valid()) {
+			CachedTexture cached;
+			cached.texture = loaded[request_i];
+			cached.modified_time = r_load.request_modified_times[request_i];
+			MutexLock lock(texture_cache_mutex);
+			texture_cache.set(r_load.request_paths[request_i], cached);
+		}
+	}
+	for (uint32_t texture_i = 0; texture_i < r_load.textures.size(); texture_i++) {
+		if (r_load.entry_requests[texture_i] >= 0) {
+			r_load.textures[texture_i] = loaded[r_load.entry_requests[texture_i]];
+		}
+	}
+}
+
+void PackedSceneMMDPMX::clear_texture_cache() {
+	MutexLock lock(texture_cache_mutex);
+	texture_cache.clear();
+}
+
+int64_t PackedSceneMMDPMX::_get_material_texture(const mmd_pmx_t::material_t *p_material) {
+	// An all-ones index of the file's index size means no texture.
+	const int64_t texture_size = p_material->texture_index()->size();
+	const int64_t texture_index = p_material->texture_index()->value();
+	const int64_t no_texture = texture_size >= 4 ? (int64_t)UINT32_MAX : (int64_t(1) << (texture_size * 8)) - 1;
+	return texture_index == no_texture ? -1 : texture_index;
+}
+
+void PackedSceneMMDPMX::_bind_textures(const mmd_pmx_t *p_pmx, const Array &p_materials, const LocalVector<Ref<Texture> > &p_textures) {
+	for (int32_t material_i = 0; material_i < p_materials.size(); material_i++) {
+		const int64_t texture_index = _get_material_texture(p_pmx->materials()->at(material_i).get());
+		if (texture_index >= 0 && texture_index < (int64_t)p_textures.size()) {
+			Ref<StandardMaterial3D> material = p_materials[material_i];
+			material->set_texture(StandardMaterial3D::TEXTURE_ALBEDO, p_textures[texture_index]);
+		}
+	}
+}
+
+// The parameters a PMX material is imported with. Materials with equal keys
+// import identically.
+struct PMXMaterialKey {
+	float diffuse[4];
+	int64_t texture;
+
+	bool operator==(const PMXMaterialKey &p_other) const {
+		return memcmp(diffuse, p_other.diffuse, sizeof(diffuse)) == 0 && texture == p_other.texture;
+	}
+};
+
+struct PMXMaterialKeyHasher {
+	static _FORCE_INLINE_ uint32_t hash(const PMXMaterialKey &p_key) {
+		return hash_djb2_one_64(p_key.texture, hash_djb2_buffer(reinterpret_cast<const uint8_t *>(p_key.diffuse), sizeof(p_key.diffuse)));
+	}
+};
+
+uint32_t PackedSceneMMDPMX::_deduplicate_materials(const mmd_pmx_t *p_pmx, const PMXTextureLoad &p_load, Array &r_materials) {
+	HashMap<PMXMaterialKey, int32_t, PMXMaterialKeyHasher> unique_materials;
+	uint32_t merged = 0;
+	for (int32_t material_i = 0; material_i < r_materials.size(); material_i++) {
+		const mmd_pmx_t::material_t *pmx_material = p_pmx->materials()->at(material_i).get();
+		const mmd_pmx_t::color4_t *diffuse = pmx_material->diffuse();
+		PMXMaterialKey key;
+		key.diffuse[0] = diffuse->r();
+		key.diffuse[1] = diffuse->g();
+		key.diffuse[2] = diffuse->b();
+		key.diffuse[3] = diffuse->a();
+		// Entries naming the same file, however they spell it, are the
+		// same texture.
+		const int64_t texture_index = _get_material_texture(pmx_material);
+		key.texture = texture_index >= 0 && texture_index < (int64_t)p_load.entry_sources.size() ? p_load.entry_sources[texture_index] : -1;
+		const int32_t *existing = unique_materials.getptr(key);
+		if (existing) {
+			// Surfaces are grouped by material object, so this also merges
+			// the surfaces.
+			r_materials[material_i] = r_materials[*existing];
+			merged++;
+		} else {
+			unique_materials.set(key, material_i);
+		}
+	}
+	return merged;
+}
+
+// Textures up to this size may be packed into an atlas, with
+// PMX_ATLAS_PADDING pixels of repeated edge around each, into an atlas of
+// at most PMX_ATLAS_MAX_SIZE. Atlases are embedded in the scene, so the
+// cap keeps one to 5.3 MiB with mipmaps once S3TC compressed, or 21 MiB
+// where no compressor is available.
+static const int32_t PMX_ATLAS_MAX_TEXTURE_SIZE = 1024;
+static const int32_t PMX_ATLAS_PADDING = 2;
+static const int32_t PMX_ATLAS_MAX_SIZE = 2048;
+
+struct PMXAtlasItem {
+	int64_t texture = -1;
+	Ref<Image> image;
+	Point2i position;
+
+	bool operator<(const PMXAtlasItem &p_other) const {
+		// Tallest first packs shelves tightly; the texture index keeps the
+		// layout deterministic.
+		if (image->get_height() != p_other.image->get_height()) {
+			return image->get_height() > p_other.image->get_height();
+		}
+		return texture < p_other.texture;
+	}
+};
+
+static bool _pack_atlas_shelves(LocalVector<PMXAtlasItem> &r_items, int32_t p_size) {
+	int32_t x = 0;
+	int32_t y = 0;
+	int32_t shelf_height = 0;
+	for (uint32_t item_i = 0; item_i < r_items.size(); item_i++) {
+		const int32_t width = r_items[item_i].image->get_width() + PMX_ATLAS_PADDING * 2;
+		const int32_t height = r_items[item_i].image->get_height() + PMX_ATLAS_PADDING * 2;
+		if (x + width > p_size) {
+			y += shelf_height;
+			x = 0;
+			shelf_height = 0;
+		}
+		if (x + width > p_size || y + height > p_size) {
+			return false;
+		}
+		r_items[item_i].position = Point2i(x + PMX_ATLAS_PADDING, y + PMX_ATLAS_PADDING);
+		x += width;
+		shelf_height = MAX(shelf_height, height);
+	}
+	return true;
+}
+
+uint32_t PackedSceneMMDPMX::_atlas_materials(mmd_pmx_t *p_pmx, Array &r_materials, const LocalVector<Ref<Texture> > &p_textures) {
+	std::vector<uint32_t> *face_indices = p_pmx->face_indices();
+	mmd_pmx_t::vertex_table_t *vertices = p_pmx->vertices();
+	const uint32_t vertex_count = p_pmx->vertex_count();
+	LocalVector<uint32_t> range_starts;
+	LocalVector<uint32_t> range_ends;
+	range_starts.resize(r_materials.size());
+	range_ends.resize(r_materials.size());
+	uint32_t start = 0;
+	for (int32_t material_i = 0; material_i < r_materials.size(); material_i++) {
+		range_starts[material_i] = start;
+		range_ends[material_i] = (uint32_t)MIN((uint64_t)start + p_pmx->materials()->at(material_i)->face_vertex_count(), (uint64_t)face_indices->size());
+		start = range_ends[material_i];
+	}
+
+	// Candidates have a small texture, no sphere map, and UVs that stay
+	// inside the texture. They are grouped by the colour the shared material
+	// will have.
+	HashMap<PMXMaterialKey, LocalVector<uint32_t>, PMXMaterialKeyHasher> groups;
+	LocalVector<PMXMaterialKey> group_order;
+	for (int32_t material_i = 0; material_i < r_materials.size(); material_i++) {
+		const mmd_pmx_t::material_t *pmx_material = p_pmx->materials()->at(material_i).get();
+		const int64_t texture_index = _get_material_texture(pmx_material);
+		if (texture_index < 0 || texture_index >= (int64_t)p_textures.size() || pmx_material->sphere_op_mode() != mmd_pmx_t::material_t::SPHERE_OP_MODE_DISABLED) {
+			continue;
+		}
+		Ref<Texture2D> texture = p_textures[texture_index];
+		if (texture.is_null() || texture->get_width() > PMX_ATLAS_MAX_TEXTURE_SIZE || texture->get_height() > PMX_ATLAS_MAX_TEXTURE_SIZE) {
+			continue;
+		}
+		bool wraps = false;
+		for (uint32_t face_vertex_i = range_starts[material_i]; face_vertex_i < range_ends[material_i] && !wraps; face_vertex_i++) {
+			const uint32_t vertex_i = (*face_indices)[face_vertex_i];
+			if (vertex_i >= vertex_count) {
+				wraps = true;
+				break;
+			}
+			const float *uv = &vertices->uvs[vertex_i * 2];
+			wraps = uv[0] < 0.0f || uv[0] > 1.0f || uv[1] < 0.0f || uv[1] > 1.0f;
+		}
+		if (wraps) {
+			continue;
+		}
+		const mmd_pmx_t::color4_t *diffuse = pmx_material->diffuse();
+		PMXMaterialKey key;
+		key.diffuse[0] = diffuse->r();
+		key.diffuse[1] = diffuse->g();
+		key.diffuse[2] = diffuse->b();
+		key.diffuse[3] = diffuse->a();
+		key.texture = -1;
+		if (!groups.has(key)) {
+			groups.set(key, LocalVector<uint32_t>());
+			group_order.push_back(key);
+		}
+		groups[key].push_back(material_i);
+	}
+
+	// A material object shared through deduplication keeps its surface as
+	// long as any PMX material still uses it.
+	HashMap<ObjectID, uint32_t> object_uses;
+	for (int32_t material_i = 0; material_i < r_materials.size(); material_i++) {
+		const ObjectID object = Object::cast_to<Object>(r_materials[material_i])->get_instance_id();
+		const uint32_t *uses = object_uses.getptr(object);
+		object_uses.set(object, uses ? *uses + 1 : 1);
+	}
+
+	uint32_t draw_calls_saved = 0;
+	// Per original vertex, the material whose copy copy_index holds.
+	LocalVector<uint32_t> copied_for;
+	LocalVector<uint32_t> copy_index;
+	copied_for.resize(vertex_count);
+	copy_index.resize(vertex_count);
+	for (uint32_t vertex_i = 0; vertex_i < vertex_count; vertex_i++) {
+		copied_for[vertex_i] = UINT32_MAX;
+	}
+	for (uint32_t group_i = 0; group_i < group_order.size(); group_i++) {
+		const LocalVector<uint32_t> &group = groups[group_order[group_i]];
+		HashMap<int64_t, Ref<Image> > images;
+		for (uint32_t member_i = 0; member_i < group.size(); member_i++) {
+			const int64_t texture_index = _get_material_texture(p_pmx->materials()->at(group[member_i]).get());
+			if (images.has(texture_index)) {
+				continue;
+			}
+			Ref<Texture2D> texture = p_textures[texture_index];
+			Ref<Image> image = texture->get_image();
+			if (image.is_valid()) {
+				image = image->duplicate();
+				if (image->is_compressed() && image->decompress() != OK) {
+					image.unref();
 				}
 			}
-			surface->set_bones(bones);
-			real_t renorm = weights[0] + weights[1] + weights[2] + weights[3];
-			if (renorm != 0.0 && renorm != 1.0) {
-				weights.write[0] /= renorm;
-				weights.write[1] /= renorm;
-				weights.write[2] /= renorm;
-				weights.write[3] /= renorm;
+			if (image.is_valid()) {
+				image->clear_mipmaps();
+				image->convert(Image::FORMAT_RGBA8);
 			}
-			surface->set_weights(weights);
-			surface->add_vertex(point);
-		}
-		std::vector<std::unique_ptr<mmd_pmx_t::face_t> > *faces = pmx.faces();
-		for (uint32_t face_vertex_i = material_index_counts[material_i].start; face_vertex_i < material_index_counts[material_i].end;
-				face_vertex_i += 3) {
-			uint32_t face_i = face_vertex_i / 3;
-			uint32_t index = faces->at(face_i)->indices()->at(0)->value();
-			surface->add_index(index);
-			index = faces->at(face_i)->indices()->at(2)->value();
-			surface->add_index(index);
-			index = faces->at(face_i)->indices()->at(1)->value();
-			surface->add_index(index);
-		}
-		Array mesh_array = surface->commit_to_arrays();
-		surface->clear();
-		String material_name = pick_universal_or_common(materials->at(material_i)->english_name()->value(), materials->at(material_i)->name()->value());
-		Ref<StandardMaterial3D> material;
-		material.instantiate();
-		int64_t texture_size = materials->at(material_i)->texture_index()->size();
-		String texture_path;
-		int64_t texture_index = materials->at(material_i)->texture_index()->value();
-		switch (texture_size) {
-			case 1: {
-				if (texture_index != UINT8_MAX) {
-					std::string raw_texture_path = pmx.textures()->at(texture_index)->name()->value();
-					texture_path.parse_utf8(raw_texture_path.data());
+			images.set(texture_index, image);
+		}
+		// Only objects whose every use has a usable texture here leave the
+		// draw list; moving part of an object's uses would save nothing.
+		HashMap<ObjectID, uint32_t> usable_uses;
+		for (uint32_t member_i = 0; member_i < group.size(); member_i++) {
+			const uint32_t material_i = group[member_i];
+			if (images[_get_material_texture(p_pmx->materials()->at(material_i).get())].is_null()) {
+				continue;
+			}
+			const ObjectID object = Object::cast_to<Object>(r_materials[material_i])->get_instance_id();
+			const uint32_t *uses = usable_uses.getptr(object);
+			usable_uses.set(object, uses ? *uses + 1 : 1);
+		}
+		LocalVector<uint32_t> members;
+		uint32_t removed_objects = 0;
+		for (uint32_t member_i = 0; member_i < group.size(); member_i++) {
+			const uint32_t material_i = group[member_i];
+			const ObjectID object = Object::cast_to<Object>(r_materials[material_i])->get_instance_id();
+			const uint32_t *uses = usable_uses.getptr(object);
+			if (uses && *uses == object_uses[object]) {
+				members.push_back(material_i);
+			}
+		}
+		for (const ObjectID *object = usable_uses.next(nullptr); object; object = usable_uses.next(object)) {
+			if (usable_uses[*object] == object_uses[*object]) {
+				removed_objects++;
+			}
+		}
+		// The atlas adds a surface of its own, so it has to remove two.
+		if (removed_objects < 2) {
+			continue;
+		}
+
+		HashMap<int64_t, uint32_t> item_indices;
+		LocalVector<PMXAtlasItem> items;
+		int64_t area = 0;
+		for (uint32_t member_i = 0; member_i < members.size(); member_i++) {
+			const int64_t texture_index = _get_material_texture(p_pmx->materials()->at(members[member_i]).get());
+			if (item_indices.has(texture_index)) {
+				continue;
+			}
+			PMXAtlasItem item;
+			item.texture = texture_index;
+			item.image = images[texture_index];
+			item_indices.set(texture_index, items.size());
+			items.push_back(item);
+			area += (int64_t)(item.image->get_width() + PMX_ATLAS_PADDING * 2) * (item.image->get_height() + PMX_ATLAS_PADDING * 2);
+		}
+		items.sort();
+		int32_t size = MAX(64, (int32_t)next_power_of_2((uint32_t)Math::ceil(Math::sqrt((double)area))));
+		while (size <= PMX_ATLAS_MAX_SIZE && !_pack_atlas_shelves(items, size)) {
+			size *= 2;
+		}
+		if (size > PMX_ATLAS_MAX_SIZE) {
+			continue;
+		}
+		for (uint32_t item_i = 0; item_i < items.size(); item_i++) {
+			item_indices[items[item_i].texture] = item_i;
+		}
+
+		Ref<Image> atlas;
+		atlas.instantiate();
+		atlas->create(size, size, false, Image::FORMAT_RGBA8);
+		for (uint32_t item_i = 0; item_i < items.size(); item_i++) {
+			const Ref<Image> &image = items[item_i].image;
+			const Point2i position = items[item_i].position;
+			const int32_t width = image->get_width();
+			const int32_t height = image->get_height();
+			atlas->blit_rect(image, Rect2i(0, 0, width, height), position);
+			// Repeat the edges into the padding so filtering near a border
+			// does not pick up a neighbour.
+			for (int32_t pad_i = 1; pad_i <= PMX_ATLAS_PADDING; pad_i++) {
+				atlas->blit_rect(image, Rect2i(0, 0, 1, height), position + Point2i(-pad_i, 0));
+				atlas->blit_rect(image, Rect2i(width - 1, 0, 1, height), position + Point2i(width - 1 + pad_i, 0));
+				atlas->blit_rect(image, Rect2i(0, 0, width, 1), position + Point2i(0, -pad_i));
+				atlas->blit_rect(image, Rect2i(0, height - 1, width, 1), position + Point2i(0, height - 1 + pad_i));
+			}
+		}
+		atlas->generate_mipmaps();
+		// Left uncompressed if the compressor is not built in; the
+		// rendering server decompresses where S3TC is unsupported.
+		atlas->compress(Image::COMPRESS_S3TC, Image::COMPRESS_SOURCE_SRGB);
+		Ref<ImageTexture> atlas_texture;
+		atlas_texture.instantiate();
+		atlas_texture->create_from_image(atlas);
+		Ref<StandardMaterial3D> atlas_material;
+		atlas_material.instantiate();
+		const uint32_t first_material = members[0];
+		atlas_material->set_name(vformat("%s Atlas", Ref<Material>(r_materials[first_material])->get_name()));
+		const PMXMaterialKey &key = group_order[group_i];
+		atlas_material->set_albedo(Color(key.diffuse[0], key.diffuse[1], key.diffuse[2], key.diffuse[3]));
+		atlas_material->set_texture(StandardMaterial3D::TEXTURE_ALBEDO, atlas_texture);
+
+		// Each material's faces get their own copies of their vertices with
+		// UVs moved into the material's rectangle, since other materials
+		// may share the originals.
+		for (uint32_t member_i = 0; member_i < members.size(); member_i++) {
+			const uint32_t material_i = members[member_i];
+			const int64_t texture_index = _get_material_texture(p_pmx->materials()->at(material_i).get());
+			const PMXAtlasItem &item = items[item_indices[texture_index]];
+			const Vector2 offset = Vector2(item.position) / size;
+			const Vector2 scale = Vector2(item.image->get_width(), item.image->get_height()) / size;
+			for (uint32_t face_vertex_i = range_starts[material_i]; face_vertex_i < range_ends[material_i]; face_vertex_i++) {
+				const uint32_t vertex_i = (*face_indices)[face_vertex_i];
+				if (copied_for[vertex_i] != material_i) {
+					copied_for[vertex_i] = material_i;
+					copy_index[vertex_i] = p_pmx->duplicate_vertex(vertex_i);
+					float *uv = &vertices->uvs[copy_index[vertex_i] * 2];
+					uv[0] = offset.x + uv[0] * scale.x;
+					uv[1] = offset.y + uv[1] * scale.y;
 				}
-			} break;
-			case 2: {
-				if (texture_index != UINT16_MAX) {
-					std::string raw_texture_path = pmx.textures()->at(texture_index)->name()->value();
-					texture_path.parse_utf8(raw_texture_path.data());
+				(*face_indices)[face_vertex_i] = copy_index[vertex_i];
+			}
+			r_materials[material_i] = atlas_material;
+		}
+		draw_calls_saved += removed_objects - 1;
+	}
+	return draw_calls_saved;
+}
+
+Ref<StandardMaterial3D> PackedSceneMMDPMX::_create_material(const mmd_pmx_t *p_pmx, uint32_t p_material) {
+	const mmd_pmx_t::material_t *pmx_material = p_pmx->materials()->at(p_material).get();
+	Ref<StandardMaterial3D> material;
+	material.instantiate();
+	material->set_name(pick_universal_or_common(pmx_material->english_name(), pmx_material->name()));
+	mmd_pmx_t::color4_t *diffuse = pmx_material->diffuse();
+	material->set_albedo(Color(diffuse->r(), diffuse->g(), diffuse->b(), diffuse->a()));
+	return material;
+}
+
+void PackedSceneMMDPMX::_partition_surfaces(const mmd_pmx_t *p_pmx, const Array &p_materials, LocalVector<PMXSurface> &r_surfaces) {
+	std::vector<std::unique_ptr<mmd_pmx_t::material_t> > *materials = p_pmx->materials();
+	const uint32_t vertex_count = p_pmx->vertex_count();
+	const uint32_t face_index_count = p_pmx->face_indices()->size();
+	const uint32_t *face_indices = p_pmx->face_indices()->data();
+
+	// Materials own consecutive index ranges. Ranges whose materials are
+	// the same object share a surface, which is named and indexed after the
+	// first of them.
+	LocalVector<uint32_t> range_starts;
+	LocalVector<uint32_t> range_ends;
+	LocalVector<uint32_t> range_surfaces;
+	range_starts.resize(p_pmx->material_count());
+	range_ends.resize(p_pmx->material_count());
+	range_surfaces.resize(p_pmx->material_count());
+	HashMap<ObjectID, uint32_t> material_surfaces;
+	uint32_t start = 0;
+	for (uint32_t material_i = 0; material_i < p_pmx->material_count(); material_i++) {
+		range_starts[material_i] = start;
+		range_ends[material_i] = (uint32_t)MIN((uint64_t)start + materials->at(material_i)->face_vertex_count(), (uint64_t)face_index_count);
+		start = range_ends[material_i];
+		const ObjectID material = Object::cast_to<Object>(p_materials[material_i])->get_instance_id();
+		const uint32_t *surface = material_surfaces.getptr(material);
+		if (surface) {
+			range_surfaces[material_i] = *surface;
+		} else {
+			range_surfaces[material_i] = r_surfaces.size();
+			material_surfaces.set(material, r_surfaces.size());
+			r_surfaces.push_back(PMXSurface());
+			r_surfaces[r_surfaces.size() - 1].material = material_i;
+		}
+	}
+
+	// Each surface collects all of its ranges before the next one starts,
+	// so last_surface can tag which surface a vertex's local_index belongs
+	// to and the table never needs clearing. Every face is visited once.
+	LocalVector<uint32_t> last_surface;
+	LocalVector<int32_t> local_index;
+	last_surface.resize(vertex_count);
+	local_index.resize(vertex_count);
+	for (uint32_t vertex_i = 0; vertex_i < vertex_count; vertex_i++) {
+		last_surface[vertex_i] = UINT32_MAX;
+	}
+	for (uint32_t surface_i = 0; surface_i < r_surfaces.size(); surface_i++) {
+		PMXSurface &surface = r_surfaces[surface_i];
+		for (uint32_t material_i = surface.material; material_i < p_pmx->material_count(); material_i++) {
+			if (range_surfaces[material_i] != surface_i) {
+				continue;
+			}
+			for (uint32_t face_vertex_i = range_starts[material_i]; face_vertex_i + 2 < range_ends[material_i]; face_vertex_i += 3) {
+				// PMX faces wind clockwise; swap the last two corners.
+				const uint32_t corners[3] = { face_indices[face_vertex_i + 0], face_indices[face_vertex_i + 2], face_indices[face_vertex_i + 1] };
+				if (corners[0] >= vertex_count || corners[1] >= vertex_count || corners[2] >= vertex_count) {
+					continue;
 				}
-			} break;
-			case 4: {
-				if (texture_index != UINT32_MAX) {
-					std::string raw_texture_path = pmx.textures()->at(texture_index)->name()->value();
-					texture_path.parse_utf8(raw_texture_path.data());
+				for (uint32_t corner_i = 0; corner_i < 3; corner_i++) {
+					const uint32_t vertex_i = corners[corner_i];
+					if (last_surface[vertex_i] != surface_i) {
+						last_surface[vertex_i] = surface_i;
+						local_index[vertex_i] = surface.vertices.size();
+						surface.vertices.push_back(vertex_i);
+					}
+					surface.indices.push_back(local_index[vertex_i]);
 				}
-			} break;
-			default:
-				break;
+			}
 		}
-		if (!texture_path.is_empty()) {
-			texture_path = p_path.get_base_dir().plus_file(texture_path);
-			texture_path = texture_path.simplify_path();
-			Ref<Texture> base_color_tex = ResourceLoader::load(texture_path);
-			material->set_texture(StandardMaterial3D::TEXTURE_ALBEDO, base_color_tex);
-		}
-		mmd_pmx_t::color4_t *diffuse = materials->at(material_i)->diffuse();
-		material->set_albedo(Color(diffuse->r(), diffuse->g(), diffuse->b(), diffuse->a()));
-		EditorSceneImporterMeshNode3D *mesh_3d = memnew(EditorSceneImporterMeshNode3D);
-		Ref<EditorSceneImporterMesh> mesh;
-		mesh.instantiate();
-		String model_name = pick_universal_or_common(pmx.header()->english_model_name()->value(), pmx.header()->model_name()->value());
-		mesh_3d->set_name(material_name);
-		mesh->add_surface(Mesh::PRIMITIVE_TRIANGLES, mesh_array, Array(), Dictionary(), material, material_name);
-		root->add_child(mesh_3d);
-		mesh_3d->set_mesh(mesh);
-		mesh_3d->set_owner(root);
-	}
-	std::vector<std::unique_ptr<mmd_pmx_t::rigid_body_t> > *rigid_bodies = pmx.rigid_bodies();
-	for (uint32_t rigid_bodies_i = 0; rigid_bodies_i < pmx.rigid_body_count(); rigid_bodies_i++) {
-		RigidBody3D *rigid_3d = memnew(RigidBody3D);
-		String rigid_name = pick_universal_or_common(rigid_bodies->at(rigid_bodies_i)->english_name()->value(),
-				rigid_bodies->at(rigid_bodies_i)->name()->value());
-		rigid_3d->set_name(rigid_name);
-		root->add_child(rigid_3d);
-		rigid_3d->set_owner(root);
 	}
-	return root;
+}
+
+void PackedSceneMMDPMX::_create_meshes(const mmd_pmx_t *p_pmx, uint32_t p_model_vertex_count, Ref<PMXMMDState> p_state, Node3D *p_root, ImportProgress *p_progress) {
+	LocalVector<PMXSurface> surfaces;
+	Array materials = p_state->get_materials();
+	_partition_surfaces(p_pmx, materials, surfaces);
+	PMXSkin skin;
+	_convert_skin(p_pmx, skin);
+	// Surfaces only read the decoded tables, so they are built concurrently.
+	// Each job writes its own slot, and nodes are created from the slots in
+	// material order below, so the scene does not depend on scheduling.
+	PMXSurfaceBuild surface_build;
+	surface_build.pmx = p_pmx;
+	surface_build.skin = &skin;
+	surface_build.surfaces = &surfaces;
+	// Quantizing only pays off through the vertices it makes identical.
+	surface_build.weld_vertices = p_state->get_weld_vertices() || p_state->get_quantize_attributes();
+	surface_build.optimize_vertex_cache = p_state->get_optimize_vertex_cache();
+	PackedFloat32Array lod_errors = p_state->get_lod_errors();
+	lod_errors.sort();
+	for (int32_t lod_i = 0; lod_i < lod_errors.size(); lod_i++) {
+		if (lod_errors[lod_i] > 0.0f && (surface_build.lod_errors.is_empty() || lod_errors[lod_i] > surface_build.lod_errors[surface_build.lod_errors.size() - 1])) {
+			surface_build.lod_errors.push_back(lod_errors[lod_i]);
+		}
+	}
+	surface_build.arrays.resize(surfaces.size());
+	ThreadWorkPool surface_pool;
+	surface_pool.init();
+	surface_pool.begin_work(surfaces.size(), this, &PackedSceneMMDPMX::_build_surface_arrays, &surface_build);
+	while (!surface_pool.is_done_dispatching()) {
+		if (p_progress->step(TTR("Building surfaces"), ImportProgress::PARSE_END, ImportProgress::SURFACES_END, surface_pool.get_work_index(), surfaces.size())) {
+			surface_build.cancelled.set();
+		}
+		OS::get_singleton()->delay_usec(1000);
+	}
+	surface_pool.end_work();
+	surface_pool.finish();
+	if (surface_build.cancelled.is_set()) {
+		return;
+	}
+	if (surface_build.weld_vertices) {
+		uint64_t vertex_count = 0;
+		uint64_t welded_vertices = 0;
+		for (uint32_t surface_i = 0; surface_i < surfaces.size(); surface_i++) {
+			vertex_count += surfaces[surface_i].vertices.size();
+			welded_vertices += surfaces[surface_i].welded_vertices;
+		}
+		Dictionary statistics = p_state->get_statistics();
+		statistics["welded_vertices"] = welded_vertices;
+		statistics["vertex_bytes"] = vertex_count * PMX_VERTEX_STRIDE;
+		statistics["vertex_bytes_saved"] = welded_vertices * PMX_VERTEX_STRIDE;
+		p_state->set_statistics(statistics);
+		print_verbose(vformat("PMX: welded %d duplicate vertices, saving %s of vertex data.", welded_vertices, String::humanize_size(welded_vertices * PMX_VERTEX_STRIDE)));
+	}
+	// The rendering server stores indices as 16 bits when a surface has at
+	// most 65536 vertices. Surfaces used to span the whole model's vertex
+	// range, so the saving is against the width the model's vertex count
+	// implied, and only for the base index buffers, which existed before.
+	const uint64_t model_index_size = p_model_vertex_count <= (1 << 16) ? sizeof(uint16_t) : sizeof(uint32_t);
+	uint64_t index_bytes = 0;
+	uint64_t index_bytes_saved = 0;
+	for (uint32_t surface_i = 0; surface_i < surfaces.size(); surface_i++) {
+		const uint64_t index_size = surfaces[surface_i].vertices.size() <= (1 << 16) ? sizeof(uint16_t) : sizeof(uint32_t);
+		uint64_t index_count = surfaces[surface_i].indices.size();
+		if (index_size < model_index_size) {
+			// An atlased surface can outgrow the model it was cut from.
+			index_bytes_saved += index_count * (model_index_size - index_size);
+		}
+		for (uint32_t lod_i = 0; lod_i < surfaces[surface_i].lod_indices.size(); lod_i++) {
+			index_count += surfaces[surface_i].lod_indices[lod_i].size();
+		}
+		index_bytes += index_count * index_size;
+	}
+	Dictionary statistics = p_state->get_statistics();
+	statistics["index_bytes"] = index_bytes;
+	statistics["index_bytes_saved"] = index_bytes_saved;
+	p_state->set_statistics(statistics);
+	print_verbose(vformat("PMX: %s of index data, %s saved by 16-bit indices.", String::humanize_size(index_bytes), String::humanize_size(index_bytes_saved)));
+	if (!surface_build.lod_errors.is_empty()) {
+		uint64_t lod_count = 0;
+		for (uint32_t surface_i = 0; surface_i < surfaces.size(); surface_i++) {
+			lod_count += surfaces[surface_i].lod_indices.size();
+		}
+		Dictionary statistics = p_state->get_statistics();
+		statistics["lod_count"] = lod_count;
+		p_state->set_statistics(statistics);
+		print_verbose(vformat("PMX: generated %d surface LODs.", lod_count));
+	}
+	if (surface_build.optimize_vertex_cache) {
+		uint64_t triangle_count = 0;
+		uint64_t vertex_count = 0;
+		uint64_t misses_before = 0;
+		uint64_t misses_after = 0;
+		for (uint32_t surface_i = 0; surface_i < surfaces.size(); surface_i++) {
+			triangle_count += surfaces[surface_i].indices.size() / 3;
+			vertex_count += surfaces[surface_i].vertices.size();
+			misses_before += surfaces[surface_i].cache_misses_before;
+			misses_after += surfaces[surface_i].cache_misses_after;
+		}
+		if (triangle_count) {
+			// ACMR is transformed vertices per triangle, ATVR per vertex; the
+			// ideal ATVR is 1.
+			Dictionary statistics = p_state->get_statistics();
+			statistics["vertex_cache_acmr_before"] = (double)misses_before / triangle_count;
+			statistics["vertex_cache_acmr_after"] = (double)misses_after / triangle_count;
+			statistics["vertex_cache_atvr_before"] = (double)misses_before / vertex_count;
+			statistics["vertex_cache_atvr_after"] = (double)misses_after / vertex_count;
+			p_state->set_statistics(statistics);
+			print_verbose(vformat("PMX: vertex cache ACMR %.3f -> %.3f, ATVR %.3f -> %.3f.",
+					statistics["vertex_cache_acmr_before"], statistics["vertex_cache_acmr_after"],
+					statistics["vertex_cache_atvr_before"], statistics["vertex_cache_atvr_after"]));
+		}
+	}
+
+	Ref<EditorSceneImporterMesh> mesh;
+	uint32_t mesh_count = 0;
+	for (uint32_t surface_i = 0; surface_i < surfaces.size(); surface_i++) {
+		if (surfaces[surface_i].indices.is_empty()) {
+			// Meshes cannot hold empty surfaces.
+			continue;
+		}
+		const Array &mesh_array = surface_build.arrays[surface_i];
+		Ref<StandardMaterial3D> material = materials[surfaces[surface_i].material];
+		String material_name = material->get_name();
+		// A single mesh still starts over when it reaches the rendering
+		// server's surface limit.
+		if (mesh.is_null() || !p_state->get_single_mesh() || mesh->get_surface_count() >= RS::MAX_MESH_SURFACES) {
+			mesh.instantiate();
+			mesh_count++;
+			EditorSceneImporterMeshNode3D *mesh_3d = memnew(EditorSceneImporterMeshNode3D);
+			// A single mesh is named after the model, and numbered once it
+			// has to be split; otherwise each mesh is named after its
+			// material.
+			if (!p_state->get_single_mesh()) {
+				mesh_3d->set_name(material_name);
+			} else if (mesh_count == 1) {
+				mesh_3d->set_name(p_state->get_model_name());
+			} else {
+				mesh_3d->set_name(vformat("%s %d", p_state->get_model_name(), mesh_count));
+			}
+			p_root->add_child(mesh_3d);
+			mesh_3d->set_mesh(mesh);
+			mesh_3d->set_owner(p_root);
+		}
+		Dictionary lods;
+		for (uint32_t lod_i = 0; lod_i < surfaces[surface_i].lod_indices.size(); lod_i++) {
+			const LocalVector<int32_t> &lod_indices = surfaces[surface_i].lod_indices[lod_i];
+			PackedInt32Array lod;
+			lod.resize(lod_indices.size());
+			memcpy(lod.ptrw(), lod_indices.ptr(), lod_indices.size() * sizeof(int32_t));
+			lods[surfaces[surface_i].lod_distances[lod_i]] = lod;
+		}
+		mesh->add_surface(Mesh::PRIMITIVE_TRIANGLES, mesh_array, Array(), lods, material, material_name);
+	}
+}
+
+void PackedSceneMMDPMX::_convert_skin(const mmd_pmx_t *p_pmx, PMXSkin &r_skin) {
+	const mmd_pmx_t::vertex_table_t *vertices = p_pmx->vertices();
+	const uint32_t slot_count = p_pmx->vertex_count() * RS::ARRAY_WEIGHTS_SIZE;
+	r_skin.bones.resize(slot_count);
+	r_skin.weights.resize(slot_count);
+	int32_t *bones = r_skin.bones.ptr();
+	float *weights = r_skin.weights.ptr();
+	const int32_t *pmx_bones = vertices->bone_indices.data();
+	const float *pmx_weights = vertices->weights.data();
+
+	// The parser already spreads every weight type over four slots, with
+	// unused slots and null bones at -1, so these loops are branch free and
+	// run over the whole table at once. SDEF skins as BDEF2 and QDEF as
+	// BDEF4, since meshes only blend linearly.
+	for (uint32_t slot_i = 0; slot_i < slot_count; slot_i++) {
+		const bool used = pmx_bones[slot_i] >= 0;
+		bones[slot_i] = used ? pmx_bones[slot_i] : 0;
+		weights[slot_i] = used ? pmx_weights[slot_i] : 0.0f;
+	}
+	for (uint32_t slot_i = 0; slot_i < slot_count; slot_i += RS::ARRAY_WEIGHTS_SIZE) {
+		float *vertex_weights = &weights[slot_i];
+		const float total = vertex_weights[0] + vertex_weights[1] + vertex_weights[2] + vertex_weights[3];
+		const float scale = total != 0.0f ? 1.0f / total : 1.0f;
+		vertex_weights[0] *= scale;
+		vertex_weights[1] *= scale;
+		vertex_weights[2] *= scale;
+		vertex_weights[3] *= scale;
+	}
+}
+
+void PackedSceneMMDPMX::_quantize_attributes(mmd_pmx_t *p_pmx) {
+	mmd_pmx_t::vertex_table_t *vertices = p_pmx->vertices();
+	const uint32_t vertex_count = p_pmx->vertex_count();
+	for (uint32_t vertex_i = 0; vertex_i < vertex_count; vertex_i++) {
+		// The rendering server keeps normals at 10 bits per component, so
+		// snapping them to that grid loses nothing.
+		float *normal = &vertices->normals[vertex_i * 3];
+		for (uint32_t axis_i = 0; axis_i < 3; axis_i++) {
+			float unorm = CLAMP(normal[axis_i] * 0.5f + 0.5f, 0.0f, 1.0f);
+			normal[axis_i] = Math::round(unorm * 1023.0f) / 1023.0f * 2.0f - 1.0f;
+		}
+		// Weights are kept as 16-bit unorm; the skin conversion
+		// renormalizes what is left.
+		float *weights = &vertices->weights[vertex_i * RS::ARRAY_WEIGHTS_SIZE];
+		for (uint32_t slot_i = 0; slot_i < RS::ARRAY_WEIGHTS_SIZE; slot_i++) {
+			weights[slot_i] = Math::round(CLAMP(weights[slot_i], 0.0f, 1.0f) * 65535.0f) / 65535.0f;
+		}
+	}
+}
+
+// Everything a surface vertex is built from. Vertices whose keys are bit
+// for bit equal produce identical mesh vertices.
+struct PMXWeldVertex {
+	float position[3];
+	float normal[3];
+	float uv[2];
+	int32_t bones[RS::ARRAY_WEIGHTS_SIZE];
+	float weights[RS::ARRAY_WEIGHTS_SIZE];
+
+	bool operator==(const PMXWeldVertex &p_other) const {
+		return memcmp(this, &p_other, sizeof(PMXWeldVertex)) == 0;
+	}
+};
+
+struct PMXWeldVertexHasher {
+	static _FORCE_INLINE_ uint32_t hash(const PMXWeldVertex &p_vertex) {
+		return hash_djb2_buffer(reinterpret_cast<const uint8_t *>(&p_vertex), sizeof(PMXWeldVertex));
+	}
+};
+
+void PackedSceneMMDPMX::_weld_surface(const mmd_pmx_t *p_pmx, const PMXSkin &p_skin, PMXSurface &r_surface) {
+	const mmd_pmx_t::vertex_table_t *vertices = p_pmx->vertices();
+	const uint32_t vertex_count = r_surface.vertices.size();
+	HashMap<PMXWeldVertex, int32_t, PMXWeldVertexHasher> unique_vertices;
+	LocalVector<int32_t> remap;
+	remap.resize(vertex_count);
+	LocalVector<uint32_t> welded;
+	welded.reserve(vertex_count);
+	for (uint32_t local_i = 0; local_i < vertex_count; local_i++) {
+		const uint32_t vertex_i = r_surface.vertices[local_i];
+		PMXWeldVertex key;
+		memcpy(key.position, &vertices->positions[vertex_i * 3], sizeof(key.position));
+		memcpy(key.normal, &vertices->normals[vertex_i * 3], sizeof(key.normal));
+		memcpy(key.uv, &vertices->uvs[vertex_i * 2], sizeof(key.uv));
+		memcpy(key.bones, &p_skin.bones[vertex_i * RS::ARRAY_WEIGHTS_SIZE], sizeof(key.bones));
+		memcpy(key.weights, &p_skin.weights[vertex_i * RS::ARRAY_WEIGHTS_SIZE], sizeof(key.weights));
+		const int32_t *existing = unique_vertices.getptr(key);
+		if (existing) {
+			remap[local_i] = *existing;
+		} else {
+			remap[local_i] = welded.size();
+			unique_vertices.set(key, remap[local_i]);
+			welded.push_back(vertex_i);
+		}
+	}
+	for (uint32_t index_i = 0; index_i < r_surface.indices.size(); index_i++) {
+		r_surface.indices[index_i] = remap[r_surface.indices[index_i]];
+	}
+	r_surface.welded_vertices = vertex_count - welded.size();
+	r_surface.vertices = welded;
+}
+
+void PackedSceneMMDPMX::_generate_surface_lods(const mmd_pmx_t *p_pmx, const PMXSkin &p_skin, const LocalVector<float> &p_lod_errors, PMXSurface &r_surface) const {
+	const mmd_pmx_t::vertex_table_t *vertices = p_pmx->vertices();
+	const uint32_t vertex_count = r_surface.vertices.size();
+	LocalVector<float> positions;
+	LocalVector<int32_t> bones;
+	LocalVector<float> weights;
+	positions.resize(vertex_count * 3);
+	bones.resize(vertex_count * RS::ARRAY_WEIGHTS_SIZE);
+	weights.resize(vertex_count * RS::ARRAY_WEIGHTS_SIZE);
+	AABB bounds;
+	for (uint32_t local_i = 0; local_i < vertex_count; local_i++) {
+		const uint32_t vertex_i = r_surface.vertices[local_i];
+		for (uint32_t axis_i = 0; axis_i < 3; axis_i++) {
+			positions[local_i * 3 + axis_i] = vertices->positions[vertex_i * 3 + axis_i] * mmd_unit_conversion;
+		}
+		memcpy(&bones[local_i * RS::ARRAY_WEIGHTS_SIZE], &p_skin.bones[vertex_i * RS::ARRAY_WEIGHTS_SIZE], RS::ARRAY_WEIGHTS_SIZE * sizeof(int32_t));
+		memcpy(&weights[local_i * RS::ARRAY_WEIGHTS_SIZE], &p_skin.weights[vertex_i * RS::ARRAY_WEIGHTS_SIZE], RS::ARRAY_WEIGHTS_SIZE * sizeof(float));
+		Vector3 position(positions[local_i * 3 + 0], positions[local_i * 3 + 1], positions[local_i * 3 + 2]);
+		if (local_i == 0) {
+			bounds.position = position;
+		} else {
+			bounds.expand_to(position);
+		}
+	}
+	const real_t size = bounds.size.length();
+	if (size == 0.0) {
+		return;
+	}
+
+	// Each LOD continues from the previous one. One that removes less than
+	// a tenth of the triangles is not worth a draw-time switch, but the next
+	// still builds on it.
+	PMXMeshSimplifier simplifier(positions.ptr(), bones.ptr(), weights.ptr(), vertex_count, r_surface.indices);
+	LocalVector<int32_t> previous = r_surface.indices;
+	uint32_t last_index_count = r_surface.indices.size();
+	for (uint32_t lod_i = 0; lod_i < p_lod_errors.size(); lod_i++) {
+		const float distance = p_lod_errors[lod_i] * size;
+		LocalVector<int32_t> lod_indices;
+		simplifier.simplify(previous, distance, lod_indices);
+		if (lod_indices.is_empty()) {
+			break;
+		}
+		if (lod_indices.size() * 10 < last_index_count * 9) {
+			last_index_count = lod_indices.size();
+			r_surface.lod_distances.push_back(distance);
+			r_surface.lod_indices.push_back(lod_indices);
+		}
+		previous = lod_indices;
+	}
+}
+
+// Size of the FIFO post-transform cache the vertex cache metrics model.
+static const uint32_t PMX_VERTEX_CACHE_SIZE = 16;
+
+static uint32_t _count_vertex_cache_misses(const LocalVector<int32_t> &p_indices, uint32_t p_vertex_count) {
+	// A vertex is cached while fewer than PMX_VERTEX_CACHE_SIZE misses have
+	// happened since it was loaded. Time starts past the cache size so that
+	// every vertex misses on first use.
+	LocalVector<uint32_t> loaded_at;
+	loaded_at.resize(p_vertex_count);
+	for (uint32_t vertex_i = 0; vertex_i < p_vertex_count; vertex_i++) {
+		loaded_at[vertex_i] = 0;
+	}
+	uint32_t time = PMX_VERTEX_CACHE_SIZE;
+	uint32_t misses = 0;
+	for (uint32_t index_i = 0; index_i < p_indices.size(); index_i++) {
+		const uint32_t vertex_i = p_indices[index_i];
+		if (time - loaded_at[vertex_i] >= PMX_VERTEX_CACHE_SIZE) {
+			loaded_at[vertex_i] = time++;
+			misses++;
+		}
+	}
+	return misses;
+}
+
+void PackedSceneMMDPMX::_optimize_surface(PMXSurface &r_surface) {
+	const uint32_t vertex_count = r_surface.vertices.size();
+	r_surface.cache_misses_before = _count_vertex_cache_misses(r_surface.indices, vertex_count);
+	// The engine's optimizer comes from the meshoptimizer module; without it
+	// only the vertex order is improved.
+	if (SurfaceTool::optimize_vertex_cache_func) {
+		LocalVector<int32_t> indices;
+		indices.resize(r_surface.indices.size());
+		SurfaceTool::optimize_vertex_cache_func(reinterpret_cast<unsigned int *>(indices.ptr()),
+				reinterpret_cast<const unsigned int *>(r_surface.indices.ptr()), r_surface.indices.size(), vertex_count);
+		r_surface.indices = indices;
+		for (uint32_t lod_i = 0; lod_i < r_surface.lod_indices.size(); lod_i++) {
+			LocalVector<int32_t> &lod_indices = r_surface.lod_indices[lod_i];
+			indices.resize(lod_indices.size());
+			SurfaceTool::optimize_vertex_cache_func(reinterpret_cast<unsigned int *>(indices.ptr()),
+					reinterpret_cast<const unsigned int *>(lod_indices.ptr()), lod_indices.size(), vertex_count);
+			lod_indices = indices;
+		}
+	}
+	// Renumber the vertices in the order the reordered triangles first use
+	// them, so vertex fetches walk the buffer forward.
+	LocalVector<int32_t> remap;
+	remap.resize(vertex_count);
+	for (uint32_t vertex_i = 0; vertex_i < vertex_count; vertex_i++) {
+		remap[vertex_i] = -1;
+	}
+	LocalVector<uint32_t> vertices;
+	vertices.reserve(vertex_count);
+	for (uint32_t index_i = 0; index_i < r_surface.indices.size(); index_i++) {
+		int32_t &index = r_surface.indices[index_i];
+		if (remap[index] < 0) {
+			remap[index] = vertices.size();
+			vertices.push_back(r_surface.vertices[index]);
+		}
+		index = remap[index];
+	}
+	// LODs only use vertices the full surface uses, so all are renumbered.
+	for (uint32_t lod_i = 0; lod_i < r_surface.lod_indices.size(); lod_i++) {
+		LocalVector<int32_t> &lod_indices = r_surface.lod_indices[lod_i];
+		for (uint32_t index_i = 0; index_i < lod_indices.size(); index_i++) {
+			lod_indices[index_i] = remap[lod_indices[index_i]];
+		}
+	}
+	r_surface.vertices = vertices;
+	r_surface.cache_misses_after = _count_vertex_cache_misses(r_surface.indices, r_surface.vertices.size());
+}
+
+void PackedSceneMMDPMX::_build_surface_arrays(uint32_t p_surface, PMXSurfaceBuild *p_build) {
+	if (p_build->cancelled.is_set() || (*p_build->surfaces)[p_surface].indices.is_empty()) {
+		return;
+	}
+	if (p_build->weld_vertices) {
+		_weld_surface(p_build->pmx, *p_build->skin, (*p_build->surfaces)[p_surface]);
+	}
+	if (!p_build->lod_errors.is_empty()) {
+		_generate_surface_lods(p_build->pmx, *p_build->skin, p_build->lod_errors, (*p_build->surfaces)[p_surface]);
+	}
+	if (p_build->optimize_vertex_cache) {
+		_optimize_surface((*p_build->surfaces)[p_surface]);
+	}
+	p_build->arrays[p_surface] = _create_surface_arrays(p_build->pmx, *p_build->skin, (*p_build->surfaces)[p_surface]);
+}
+
+Array PackedSceneMMDPMX::_create_surface_arrays(const mmd_pmx_t *p_pmx, const PMXSkin &p_skin, const PMXSurface &p_surface) const {
+	const mmd_pmx_t::vertex_table_t *vertices = p_pmx->vertices();
+	const uint32_t vertex_count = p_surface.vertices.size();
+	const uint32_t *surface_vertices = p_surface.vertices.ptr();
+
+	// Each attribute is gathered from the vertex table straight into its
+	// final array.
+	PackedVector3Array points;
+	points.resize(vertex_count);
+	Vector3 *points_w = points.ptrw();
+	for (uint32_t local_i = 0; local_i < vertex_count; local_i++) {
+		const float *position = &vertices->positions[surface_vertices[local_i] * 3];
+		points_w[local_i] = Vector3(position[0], position[1], position[2]) * mmd_unit_conversion;
+	}
+	PackedVector3Array normals;
+	normals.resize(vertex_count);
+	Vector3 *normals_w = normals.ptrw();
+	for (uint32_t local_i = 0; local_i < vertex_count; local_i++) {
+		const float *normal = &vertices->normals[surface_vertices[local_i] * 3];
+		normals_w[local_i] = Vector3(normal[0], normal[1], normal[2]);
+	}
+	PackedVector2Array uvs;
+	uvs.resize(vertex_count);
+	Vector2 *uvs_w = uvs.ptrw();
+	for (uint32_t local_i = 0; local_i < vertex_count; local_i++) {
+		const float *uv = &vertices->uvs[surface_vertices[local_i] * 2];
+		uvs_w[local_i] = Vector2(uv[0], uv[1]);
+	}
+
+	// The skin was converted for the whole model up front; each vertex's
+	// four slots are copied as a block.
+	PackedInt32Array bones;
+	bones.resize(vertex_count * RS::ARRAY_WEIGHTS_SIZE);
+	int32_t *bones_w = bones.ptrw();
+	PackedFloat32Array weights;
+	weights.resize(vertex_count * RS::ARRAY_WEIGHTS_SIZE);
+	float *weights_w = weights.ptrw();
+	for (uint32_t local_i = 0; local_i < vertex_count; local_i++) {
+		const uint32_t vertex_i = surface_vertices[local_i];
+		memcpy(&bones_w[local_i * RS::ARRAY_WEIGHTS_SIZE], &p_skin.bones[vertex_i * RS::ARRAY_WEIGHTS_SIZE], RS::ARRAY_WEIGHTS_SIZE * sizeof(int32_t));
+		memcpy(&weights_w[local_i * RS::ARRAY_WEIGHTS_SIZE], &p_skin.weights[vertex_i * RS::ARRAY_WEIGHTS_SIZE], RS::ARRAY_WEIGHTS_SIZE * sizeof(float));
+	}
+
+	PackedInt32Array indices;
+	indices.resize(p_surface.indices.size());
+	memcpy(indices.ptrw(), p_surface.indices.ptr(), p_surface.indices.size() * sizeof(int32_t));
+
+	Array mesh_array;
+	mesh_array.resize(Mesh::ARRAY_MAX);
+	mesh_array[Mesh::ARRAY_VERTEX] = points;
+	mesh_array[Mesh::ARRAY_NORMAL] = normals;
+	mesh_array[Mesh::ARRAY_TEX_UV] = uvs;
+	mesh_array[Mesh::ARRAY_BONES] = bones;
+	mesh_array[Mesh::ARRAY_WEIGHTS] = weights;
+	mesh_array[Mesh::ARRAY_INDEX] = indices;
+	return mesh_array;
 }
 
 void PackedSceneMMDPMX::pack_mmd_pmx(String p_path, int32_t p_flags,
@@ -334,12 +1489,41 @@ void PackedSceneMMDPMX::pack_mmd_pmx(String p_path, int32_t p_flags,
 	pack(root);
 }
 
-String PackedSceneMMDPMX::pick_universal_or_common(std::string p_universal, std::string p_common) {
-	String output_name;
-	if (p_universal.empty()) {
-		output_name.parse_utf8(p_common.data());
+void PackedSceneMMDPMX::_read_pmx_section(uint32_t p_job, PMXSectionRead *p_read) {
+	if (p_read->cancelled.is_set()) {
+		return;
+	}
+	// Runs on a pool thread, so exceptions must not escape.
+	try {
+		if (p_job < p_read->sections.size()) {
+			p_read->pmx->read_section(p_read->sections[p_job]);
+		} else {
+			p_read->pmx->read_vertex_chunk(p_job - p_read->sections.size());
+		}
+	} catch (const std::exception &e) {
+		p_read->errors[p_job] = e.what();
+	}
+}
+
+String PackedSceneMMDPMX::pick_universal_or_common(const mmd_pmx_t::len_string_t *p_universal, const mmd_pmx_t::len_string_t *p_common) {
+	if (p_universal->raw().empty()) {
+		return convert_string(p_common);
+	}
+	return convert_string(p_universal);
+}
+
+String PackedSceneMMDPMX::convert_string(const mmd_pmx_t::len_string_t *p_string) {
+	// Decode the raw bytes straight into a String, honoring the encoding
+	// declared in the header, instead of going through UTF-8 first.
+	const std::string &raw = p_string->raw();
+	String output;
+	if (raw.empty()) {
+		return output;
+	}
+	if (p_string->encoding() == 1) {
+		output.parse_utf8(raw.data(), raw.size());
 	} else {
-		output_name.parse_utf8(p_universal.data());
+		output.parse_utf16(reinterpret_cast<const char16_t *>(raw.data()), raw.size() / 2);
 	}
-	return output_name;
+	return output;
 }
@@ -31,14 +31,20 @@
 #ifndef EDITOR_SCENE_IMPORTER_MMX_PMX_H
 #define EDITOR_SCENE_IMPORTER_MMX_PMX_H
 
+#include "core/os/mutex.h"
+#include "core/templates/hash_map.h"
+#include "core/templates/local_vector.h"
+#include "core/templates/safe_refcount.h"
 #include "editor/import/resource_importer_scene.h"
 #include "scene/main/node.h"
+#include "scene/resources/material.h"
 #include "scene/resources/packed_scene.h"
 #include "scene/resources/surface_tool.h"
 
 #include "thirdparty/ksy/mmd_pmx.h"
 
 class Animation;
+class Node3D;
 
 #ifdef TOOLS_ENABLED
 class EditorSceneImporterMMDPMX : public EditorSceneImporter {
@@ -58,13 +64,179 @@ public:
 
 class PMXMMDState : public Resource {
 	GDCLASS(PMXMMDState, Resource);
+
+public:
+	// Which parts of the model an import builds. Sections that no requested
+	// part needs are not decoded, and the file is not scanned past the last
+	// one that is.
+	enum ImportSection {
+		IMPORT_SECTION_METADATA = 1 << 0, // Header, textures and materials.
+		IMPORT_SECTION_GEOMETRY = 1 << 1, // Meshes; implies metadata.
+		IMPORT_SECTION_SKELETON = 1 << 2,
+		IMPORT_SECTION_MORPHS = 1 << 3,
+		IMPORT_SECTION_DISPLAY_FRAMES = 1 << 4,
+		IMPORT_SECTION_PHYSICS = 1 << 5, // Rigid bodies and joints.
+		IMPORT_SECTION_ALL = (1 << 6) - 1,
+		IMPORT_SECTION_DEFAULT = IMPORT_SECTION_METADATA | IMPORT_SECTION_GEOMETRY | IMPORT_SECTION_PHYSICS,
+	};
+
+private:
+	int32_t import_sections = IMPORT_SECTION_DEFAULT;
+	String model_name;
+	Array materials;
+	bool deduplicate_materials = false;
+	bool atlas_textures = false;
+	bool single_mesh = false;
+	bool weld_vertices = false;
+	bool quantize_attributes = false;
+	bool optimize_vertex_cache = false;
+	PackedFloat32Array lod_errors;
+	bool cache_textures = false;
+	Dictionary statistics;
+
+protected:
+	static void _bind_methods();
+
+public:
+	void set_import_sections(int32_t p_import_sections);
+	int32_t get_import_sections() const;
+	void set_model_name(const String &p_model_name);
+	String get_model_name() const;
+	void set_materials(const Array &p_materials);
+	Array get_materials() const;
+	// Share one material between PMX materials that import identically, and
+	// merge their surfaces.
+	void set_deduplicate_materials(bool p_deduplicate_materials);
+	bool get_deduplicate_materials() const;
+	// Pack the small textures of materials with the same colour into one
+	// atlas and draw those materials as one surface. Materials with sphere
+	// maps or UVs outside the texture are left alone. Each atlas is embedded
+	// in the scene: at most 2048x2048, S3TC compressed where the editor can
+	// (up to 5.3 MiB with mipmaps, 21 MiB uncompressed).
+	void set_atlas_textures(bool p_atlas_textures);
+	bool get_atlas_textures() const;
+	// Emit one mesh with a surface per material, rather than a mesh node
+	// per material. Models with more materials than a mesh can hold
+	// surfaces (RS::MAX_MESH_SURFACES) get one more mesh per that many.
+	void set_single_mesh(bool p_single_mesh);
+	bool get_single_mesh() const;
+	// Merge vertices that are exact duplicates within a surface.
+	void set_weld_vertices(bool p_weld_vertices);
+	bool get_weld_vertices() const;
+	// Snap normals and weights to the precision the rendering server stores,
+	// then weld the vertices this makes identical. Nothing visible is lost.
+	// This turns on weld_vertices, and the vertices it merges are counted
+	// with the other welded ones; there is no separate report.
+	void set_quantize_attributes(bool p_quantize_attributes);
+	bool get_quantize_attributes() const;
+	// Reorder each surface's triangles for the post-transform vertex cache
+	// and its vertices for fetch locality.
+	void set_optimize_vertex_cache(bool p_optimize_vertex_cache);
+	bool get_optimize_vertex_cache() const;
+	// Generate a LOD per entry, each allowed to deviate from the surface by
+	// that fraction of the surface's size. Empty generates none.
+	void set_lod_errors(const PackedFloat32Array &p_lod_errors);
+	PackedFloat32Array get_lod_errors() const;
+	// Keep loaded textures across imports, so models sharing a texture set
+	// load it once. See PackedSceneMMDPMX::clear_texture_cache().
+	void set_cache_textures(bool p_cache_textures);
+	bool get_cache_textures() const;
+	// Measurements from the last import, such as vertex cache efficiency.
+	void set_statistics(const Dictionary &p_statistics);
+	Dictionary get_statistics() const;
 };
 
+VARIANT_ENUM_CAST(PMXMMDState::ImportSection);
+
 class PackedSceneMMDPMX : public PackedScene {
 	GDCLASS(PackedSceneMMDPMX, PackedScene);
 
 	const real_t mmd_unit_conversion = 0.079f;
-	String pick_universal_or_common(std::string p_universal, std::string p_common);
+
+	// Jobs are the requested sections other than the vertices, followed by
+	// the vertex chunks; the sections go first so the long morph section
+	// starts early.
+	struct PMXSectionRead {
+		mmd_pmx_t *pmx = nullptr;
+		LocalVector<mmd_pmx_t::section_t> sections;
+		LocalVector<String> errors;
+		SafeFlag cancelled;
+	};
+	struct ImportProgress;
+	// One per distinct material: the model vertices its faces use, in
+	// first-use order, and its triangles indexed into that set.
+	struct PMXSurface {
+		// First PMX material drawn with this surface.
+		uint32_t material = 0;
+		LocalVector<uint32_t> vertices;
+		LocalVector<int32_t> indices;
+		// Simplified index buffers over the same vertices, by increasing
+		// error distance.
+		LocalVector<float> lod_distances;
+		LocalVector<LocalVector<int32_t> > lod_indices;
+		uint32_t welded_vertices = 0;
+		uint32_t cache_misses_before = 0;
+		uint32_t cache_misses_after = 0;
+	};
+	static void _partition_surfaces(const mmd_pmx_t *p_pmx, const Array &p_materials, LocalVector<PMXSurface> &r_surfaces);
+	// Bones and weights for every model vertex, in the layout meshes use.
+	struct PMXSkin {
+		LocalVector<int32_t> bones;
+		LocalVector<float> weights;
+	};
+	static void _convert_skin(const mmd_pmx_t *p_pmx, PMXSkin &r_skin);
+	Array _create_surface_arrays(const mmd_pmx_t *p_pmx, const PMXSkin &p_skin, const PMXSurface &p_surface) const;
+	struct PMXSurfaceBuild {
+		const mmd_pmx_t *pmx = nullptr;
+		const PMXSkin *skin = nullptr;
+		LocalVector<PMXSurface> *surfaces = nullptr;
+		bool weld_vertices = false;
+		bool optimize_vertex_cache = false;
+		LocalVector<float> lod_errors;
+		LocalVector<Array> arrays;
+		SafeFlag cancelled;
+	};
+	static void _quantize_attributes(mmd_pmx_t *p_pmx);
+	static void _weld_surface(const mmd_pmx_t *p_pmx, const PMXSkin &p_skin, PMXSurface &r_surface);
+	void _generate_surface_lods(const mmd_pmx_t *p_pmx, const PMXSkin &p_skin, const LocalVector<float> &p_lod_errors, PMXSurface &r_surface) const;
+	static void _optimize_surface(PMXSurface &r_surface);
+	void _build_surface_arrays(uint32_t p_surface, PMXSurfaceBuild *p_build);
+	void _read_pmx_section(uint32_t p_job, PMXSectionRead *p_read);
+	static uint32_t _get_pmx_section_mask(int32_t p_import_sections);
+	struct CachedTexture {
+		Ref<Texture> texture;
+		uint64_t modified_time = 0;
+	};
+	static Mutex texture_cache_mutex;
+	static HashMap<String, CachedTexture> texture_cache;
+	// Textures being loaded on the resource loader's threads. Entries of the
+	// PMX texture table that name the same path share one request.
+	struct PMXTextureLoad {
+		bool use_cache = false;
+		LocalVector<String> request_paths;
+		LocalVector<uint64_t> request_modified_times;
+		// Request each texture entry waits on, or -1 if it was resolved
+		// from the cache or cannot be loaded.
+		LocalVector<int32_t> entry_requests;
+		// First texture entry resolving to the same file as each entry, or
+		// -1 if it resolves to none.
+		LocalVector<int32_t> entry_sources;
+		LocalVector<Ref<Texture> > textures;
+		// Texture entries found on disk, and the names of those that were
+		// not.
+		uint32_t resolved_names = 0;
+		LocalVector<String> unresolved_names;
+	};
+	void _request_textures(const mmd_pmx_t *p_pmx, const String &p_path, bool p_use_cache, PMXTextureLoad &r_load);
+	void _finish_textures(PMXTextureLoad &r_load, ImportProgress *p_progress);
+	static int64_t _get_material_texture(const mmd_pmx_t::material_t *p_material);
+	static uint32_t _deduplicate_materials(const mmd_pmx_t *p_pmx, const PMXTextureLoad &p_load, Array &r_materials);
+	static uint32_t _atlas_materials(mmd_pmx_t *p_pmx, Array &r_materials, const LocalVector<Ref<Texture> > &p_textures);
+	static void _bind_textures(const mmd_pmx_t *p_pmx, const Array &p_materials, const LocalVector<Ref<Texture> > &p_textures);
+	Ref<StandardMaterial3D> _create_material(const mmd_pmx_t *p_pmx, uint32_t p_material);
+	void _create_meshes(const mmd_pmx_t *p_pmx, uint32_t p_model_vertex_count, Ref<PMXMMDState> p_state, Node3D *p_root, ImportProgress *p_progress);
+	String pick_universal_or_common(const mmd_pmx_t::len_string_t *p_universal, const mmd_pmx_t::len_string_t *p_common);
+	String convert_string(const mmd_pmx_t::len_string_t *p_string);
 
 protected:
 	static void _bind_methods();
@@ -76,6 +248,8 @@ public:
 			Error *r_err,
 			Ref<PMXMMDState> r_state);
 	virtual Node *import_mmd_pmx_scene(const String &p_path, uint32_t p_flags, float p_bake_fps, Ref<PMXMMDState> r_state = Ref<PMXMMDState>());
+	// Drops the textures kept by imports with cache_textures set.
+	static void clear_texture_cache();
 	virtual void pack_mmd_pmx(String p_path, int32_t p_flags = 0,
 			real_t p_bake_fps = 1000.0f, Ref<PMXMMDState> r_state = Ref<PMXMMDState>());
 };
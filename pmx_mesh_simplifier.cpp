@@ -0,0 +1,335 @@
+/*************************************************************************/
+/*  pmx_mesh_simplifier.cpp                                              */
+/*************************************************************************/
+/*                       This file is part of:                           */
+/*                           GODOT ENGINE                                */
+/*                      https://godotengine.org                          */
+/*************************************************************************/
+/* Copyright (c) 2007-2021 Juan Linietsky, Ariel Manzur.                 */
+/* Copyright (c) 2014-2021 Godot Engine contributors (cf. AUTHORS.md).   */
+/*                                                                       */
+/* Permission is hereby granted, free of charge, to any person obtaining */
+/* a copy of this software and associated documentation files (the       */
+/* "Software"), to deal in the Software without restriction, including   */
+/* without limitation the rights to use, copy, modify, merge, publish,   */
+/* distribute, sublicense, and/or sell copies of the Software, and to    */
+/* permit persons to whom the Software is furnished to do so, subject to */
+/* the following conditions:                                             */
+/*                                                                       */
+/* The above copyright notice and this permission notice shall be        */
+/* included in all copies or substantial portions of the Software.       */
+/*                                                                       */
+/* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,       */
+/* EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF    */
+/* MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.*/
+/* IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY  */
+/* CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,  */
+/* TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE     */
+/* SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.                */
+/*************************************************************************/
+
+#include "pmx_mesh_simplifier.h"
+
+#include <math.h>
+#include <string.h>
+
+// A symmetric 4x4 quadric is stored as its upper triangle (a00 a01 a02 a03
+// a11 a12 a13 a22 a23 a33) followed by the total area that contributed.
+static const uint32_t QUADRIC_SIZE = 11;
+
+// Collapses per pass are limited to vertices whose neighbourhoods do not
+// overlap, so a pass never invalidates the costs it is working from.
+static const uint32_t MAX_PASSES = 64;
+
+namespace {
+struct PositionKey {
+	float position[3];
+	uint32_t vertex;
+
+	bool operator<(const PositionKey &p_other) const {
+		int compare = memcmp(position, p_other.position, sizeof(position));
+		return compare < 0 || (compare == 0 && vertex < p_other.vertex);
+	}
+};
+
+struct Collapse {
+	double error;
+	uint32_t from;
+	uint32_t to;
+
+	bool operator<(const Collapse &p_other) const {
+		// Ties break on the vertices so the result does not depend on the
+		// sort's stability.
+		if (error != p_other.error) {
+			return error < p_other.error;
+		}
+		return from < p_other.from || (from == p_other.from && to < p_other.to);
+	}
+};
+
+void triangle_normal(const float *p_a, const float *p_b, const float *p_c, double *r_normal) {
+	const double ab[3] = { p_b[0] - p_a[0], p_b[1] - p_a[1], p_b[2] - p_a[2] };
+	const double ac[3] = { p_c[0] - p_a[0], p_c[1] - p_a[1], p_c[2] - p_a[2] };
+	r_normal[0] = ab[1] * ac[2] - ab[2] * ac[1];
+	r_normal[1] = ab[2] * ac[0] - ab[0] * ac[2];
+	r_normal[2] = ab[0] * ac[1] - ab[1] * ac[0];
+}
+} // namespace
+
+PMXMeshSimplifier::PMXMeshSimplifier(const float *p_positions, const int32_t *p_bones, const float *p_weights, uint32_t p_vertex_count, const LocalVector<int32_t> &p_indices) {
+	positions = p_positions;
+	vertex_count = p_vertex_count;
+	locked.resize(vertex_count);
+	dominant_bones.resize(vertex_count);
+	quadrics.resize(vertex_count * QUADRIC_SIZE);
+	for (uint32_t vertex_i = 0; vertex_i < vertex_count; vertex_i++) {
+		locked[vertex_i] = false;
+		const int32_t *bones = &p_bones[vertex_i * 4];
+		const float *weights = &p_weights[vertex_i * 4];
+		uint32_t dominant = 0;
+		for (uint32_t slot_i = 1; slot_i < 4; slot_i++) {
+			if (weights[slot_i] > weights[dominant]) {
+				dominant = slot_i;
+			}
+		}
+		dominant_bones[vertex_i] = bones[dominant];
+	}
+	for (uint32_t value_i = 0; value_i < quadrics.size(); value_i++) {
+		quadrics[value_i] = 0.0;
+	}
+
+	// Vertices sharing a position sit on a seam. Topology is judged on the
+	// first vertex at each position, so a seam does not look like a border.
+	LocalVector<PositionKey> keys;
+	keys.resize(vertex_count);
+	for (uint32_t vertex_i = 0; vertex_i < vertex_count; vertex_i++) {
+		memcpy(keys[vertex_i].position, &positions[vertex_i * 3], sizeof(keys[vertex_i].position));
+		keys[vertex_i].vertex = vertex_i;
+	}
+	keys.sort();
+	LocalVector<uint32_t> canonical;
+	canonical.resize(vertex_count);
+	for (uint32_t key_i = 0; key_i < vertex_count;) {
+		uint32_t run_end = key_i + 1;
+		while (run_end < vertex_count && memcmp(keys[run_end].position, keys[key_i].position, sizeof(keys[key_i].position)) == 0) {
+			run_end++;
+		}
+		for (uint32_t run_i = key_i; run_i < run_end; run_i++) {
+			canonical[keys[run_i].vertex] = keys[key_i].vertex;
+			locked[keys[run_i].vertex] = run_end - key_i > 1;
+		}
+		key_i = run_end;
+	}
+
+	// An edge used by a single triangle is on a border; both its ends stay.
+	LocalVector<uint64_t> edges;
+	edges.reserve(p_indices.size());
+	for (uint32_t index_i = 0; index_i + 2 < p_indices.size(); index_i += 3) {
+		for (uint32_t corner_i = 0; corner_i < 3; corner_i++) {
+			uint64_t a = canonical[p_indices[index_i + corner_i]];
+			uint64_t b = canonical[p_indices[index_i + (corner_i + 1) % 3]];
+			edges.push_back(a < b ? (a << 32) | b : (b << 32) | a);
+		}
+		_add_triangle_quadric(&p_indices[index_i]);
+	}
+	edges.sort();
+	for (uint32_t edge_i = 0; edge_i < edges.size();) {
+		uint32_t run_end = edge_i + 1;
+		while (run_end < edges.size() && edges[run_end] == edges[edge_i]) {
+			run_end++;
+		}
+		if (run_end - edge_i == 1) {
+			locked[edges[edge_i] >> 32] = true;
+			locked[edges[edge_i] & UINT32_MAX] = true;
+		}
+		edge_i = run_end;
+	}
+	// The flags were set on canonical vertices; spread them to the rest of
+	// each position's vertices.
+	for (uint32_t vertex_i = 0; vertex_i < vertex_count; vertex_i++) {
+		if (locked[canonical[vertex_i]]) {
+			locked[vertex_i] = true;
+		}
+	}
+}
+
+void PMXMeshSimplifier::_add_triangle_quadric(const int32_t *p_triangle) {
+	const float *a = &positions[p_triangle[0] * 3];
+	double normal[3];
+	triangle_normal(a, &positions[p_triangle[1] * 3], &positions[p_triangle[2] * 3], normal);
+	const double length = sqrt(normal[0] * normal[0] + normal[1] * normal[1] + normal[2] * normal[2]);
+	if (length == 0.0) {
+		return;
+	}
+	// Weighted by area, so the error of a collapse is an average squared
+	// distance to the planes it moves away from.
+	const double area = length * 0.5;
+	const double nx = normal[0] / length;
+	const double ny = normal[1] / length;
+	const double nz = normal[2] / length;
+	const double d = -(nx * a[0] + ny * a[1] + nz * a[2]);
+	const double plane[QUADRIC_SIZE] = {
+		nx * nx, nx * ny, nx * nz, nx * d,
+		ny * ny, ny * nz, ny * d,
+		nz * nz, nz * d,
+		d * d,
+		1.0
+	};
+	for (uint32_t corner_i = 0; corner_i < 3; corner_i++) {
+		double *quadric = &quadrics[p_triangle[corner_i] * QUADRIC_SIZE];
+		for (uint32_t value_i = 0; value_i < QUADRIC_SIZE; value_i++) {
+			quadric[value_i] += plane[value_i] * area;
+		}
+	}
+}
+
+double PMXMeshSimplifier::_collapse_error(uint32_t p_from, uint32_t p_to) const {
+	const double *q = &quadrics[p_from * QUADRIC_SIZE];
+	if (q[10] == 0.0) {
+		return 0.0;
+	}
+	const double x = positions[p_to * 3 + 0];
+	const double y = positions[p_to * 3 + 1];
+	const double z = positions[p_to * 3 + 2];
+	const double error = q[0] * x * x + 2.0 * q[1] * x * y + 2.0 * q[2] * x * z + 2.0 * q[3] * x +
+			q[4] * y * y + 2.0 * q[5] * y * z + 2.0 * q[6] * y +
+			q[7] * z * z + 2.0 * q[8] * z +
+			q[9];
+	return MAX(error, 0.0) / q[10];
+}
+
+bool PMXMeshSimplifier::_flips(uint32_t p_from, uint32_t p_to, const LocalVector<int32_t> &p_indices, const LocalVector<uint32_t> &p_first_triangle, const LocalVector<uint32_t> &p_triangles) const {
+	for (uint32_t adjacent_i = p_first_triangle[p_from]; adjacent_i < p_first_triangle[p_from + 1]; adjacent_i++) {
+		const int32_t *triangle = &p_indices[p_triangles[adjacent_i] * 3];
+		if ((uint32_t)triangle[0] == p_to || (uint32_t)triangle[1] == p_to || (uint32_t)triangle[2] == p_to) {
+			// Collapses away.
+			continue;
+		}
+		const float *corners[3];
+		const float *moved[3];
+		for (uint32_t corner_i = 0; corner_i < 3; corner_i++) {
+			corners[corner_i] = &positions[triangle[corner_i] * 3];
+			moved[corner_i] = (uint32_t)triangle[corner_i] == p_from ? &positions[p_to * 3] : corners[corner_i];
+		}
+		double before[3];
+		double after[3];
+		triangle_normal(corners[0], corners[1], corners[2], before);
+		triangle_normal(moved[0], moved[1], moved[2], after);
+		const double dot = before[0] * after[0] + before[1] * after[1] + before[2] * after[2];
+		const double after_length_sq = after[0] * after[0] + after[1] * after[1] + after[2] * after[2];
+		const double before_length_sq = before[0] * before[0] + before[1] * before[1] + before[2] * before[2];
+		// Reject turning a face by more than about 75 degrees, which also
+		// catches slivers that collapse to a line.
+		if (dot <= 0.25 * sqrt(before_length_sq * after_length_sq)) {
+			return true;
+		}
+	}
+	return false;
+}
+
+float PMXMeshSimplifier::simplify(const LocalVector<int32_t> &p_indices, float p_max_error, LocalVector<int32_t> &r_indices) {
+	r_indices = p_indices;
+	const double max_error_sq = (double)p_max_error * p_max_error;
+	double worst_error_sq = 0.0;
+	LocalVector<uint32_t> first_triangle;
+	LocalVector<uint32_t> triangles;
+	LocalVector<Collapse> collapses;
+	LocalVector<bool> touched;
+	LocalVector<uint32_t> collapse_to;
+	first_triangle.resize(vertex_count + 1);
+	touched.resize(vertex_count);
+	collapse_to.resize(vertex_count);
+
+	for (uint32_t pass_i = 0; pass_i < MAX_PASSES; pass_i++) {
+		const uint32_t triangle_count = r_indices.size() / 3;
+		// Vertex to triangle adjacency, as offsets into one flat list.
+		for (uint32_t vertex_i = 0; vertex_i <= vertex_count; vertex_i++) {
+			first_triangle[vertex_i] = 0;
+		}
+		for (uint32_t index_i = 0; index_i < triangle_count * 3; index_i++) {
+			first_triangle[r_indices[index_i] + 1]++;
+		}
+		for (uint32_t vertex_i = 0; vertex_i < vertex_count; vertex_i++) {
+			first_triangle[vertex_i + 1] += first_triangle[vertex_i];
+		}
+		triangles.resize(triangle_count * 3);
+		LocalVector<uint32_t> fill = first_triangle;
+		for (uint32_t index_i = 0; index_i < triangle_count * 3; index_i++) {
+			triangles[fill[r_indices[index_i]]++] = index_i / 3;
+		}
+
+		collapses.clear();
+		for (uint32_t index_i = 0; index_i < triangle_count * 3; index_i++) {
+			const uint32_t a = r_indices[index_i];
+			const uint32_t b = r_indices[index_i - index_i % 3 + (index_i + 1) % 3];
+			if (dominant_bones[a] != dominant_bones[b]) {
+				continue;
+			}
+			// Interior edges are seen once from each side, so both
+			// directions are considered; a duplicate is harmless since the
+			// first one taken touches both ends.
+			for (uint32_t direction_i = 0; direction_i < 2; direction_i++) {
+				Collapse collapse;
+				collapse.from = direction_i ? b : a;
+				collapse.to = direction_i ? a : b;
+				if (locked[collapse.from]) {
+					continue;
+				}
+				collapse.error = _collapse_error(collapse.from, collapse.to);
+				if (collapse.error <= max_error_sq) {
+					collapses.push_back(collapse);
+				}
+			}
+		}
+		if (collapses.is_empty()) {
+			break;
+		}
+		collapses.sort();
+
+		for (uint32_t vertex_i = 0; vertex_i < vertex_count; vertex_i++) {
+			touched[vertex_i] = false;
+			collapse_to[vertex_i] = vertex_i;
+		}
+		uint32_t collapsed = 0;
+		for (uint32_t collapse_i = 0; collapse_i < collapses.size(); collapse_i++) {
+			const Collapse &collapse = collapses[collapse_i];
+			if (touched[collapse.from] || touched[collapse.to] || _flips(collapse.from, collapse.to, r_indices, first_triangle, triangles)) {
+				continue;
+			}
+			collapse_to[collapse.from] = collapse.to;
+			// Everything around the removed vertex changes shape, so none of
+			// it may move again in this pass.
+			for (uint32_t adjacent_i = first_triangle[collapse.from]; adjacent_i < first_triangle[collapse.from + 1]; adjacent_i++) {
+				const int32_t *triangle = &r_indices[triangles[adjacent_i] * 3];
+				touched[triangle[0]] = true;
+				touched[triangle[1]] = true;
+				touched[triangle[2]] = true;
+			}
+			double *from_quadric = &quadrics[collapse.from * QUADRIC_SIZE];
+			double *to_quadric = &quadrics[collapse.to * QUADRIC_SIZE];
+			for (uint32_t value_i = 0; value_i < QUADRIC_SIZE; value_i++) {
+				to_quadric[value_i] += from_quadric[value_i];
+			}
+			worst_error_sq = MAX(worst_error_sq, collapse.error);
+			collapsed++;
+		}
+		if (!collapsed) {
+			break;
+		}
+
+		// Drop the triangles that collapsed to lines.
+		uint32_t write_i = 0;
+		for (uint32_t index_i = 0; index_i < triangle_count * 3; index_i += 3) {
+			const int32_t a = collapse_to[r_indices[index_i + 0]];
+			const int32_t b = collapse_to[r_indices[index_i + 1]];
+			const int32_t c = collapse_to[r_indices[index_i + 2]];
+			if (a != b && b != c && c != a) {
+				r_indices[write_i++] = a;
+				r_indices[write_i++] = b;
+				r_indices[write_i++] = c;
+			}
+		}
+		r_indices.resize(write_i);
+	}
+	return sqrt(worst_error_sq);
+}
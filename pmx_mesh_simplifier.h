@@ -0,0 +1,66 @@
+/*************************************************************************/
+/*  pmx_mesh_simplifier.h                                                */
+/*************************************************************************/
+/*                       This file is part of:                           */
+/*                           GODOT ENGINE                                */
+/*                      https://godotengine.org                          */
+/*************************************************************************/
+/* Copyright (c) 2007-2021 Juan Linietsky, Ariel Manzur.                 */
+/* Copyright (c) 2014-2021 Godot Engine contributors (cf. AUTHORS.md).   */
+/*                                                                       */
+/* Permission is hereby granted, free of charge, to any person obtaining */
+/* a copy of this software and associated documentation files (the       */
+/* "Software"), to deal in the Software without restriction, including   */
+/* without limitation the rights to use, copy, modify, merge, publish,   */
+/* distribute, sublicense, and/or sell copies of the Software, and to    */
+/* permit persons to whom the Software is furnished to do so, subject to */
+/* the following conditions:                                             */
+/*                                                                       */
+/* The above copyright notice and this permission notice shall be        */
+/* included in all copies or substantial portions of the Software.       */
+/*                                                                       */
+/* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,       */
+/* EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF    */
+/* MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.*/
+/* IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY  */
+/* CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,  */
+/* TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE     */
+/* SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.                */
+/*************************************************************************/
+
+#ifndef PMX_MESH_SIMPLIFIER_H
+#define PMX_MESH_SIMPLIFIER_H
+
+#include "core/templates/local_vector.h"
+
+// Builds LOD index buffers for a skinned surface by collapsing vertices onto
+// their neighbours. No vertex is moved or created, so every LOD shares the
+// surface's vertex arrays.
+//
+// Vertices on an open border or a UV/normal seam (several vertices at one
+// position) never move, and a vertex only collapses onto a neighbour with the
+// same dominant bone, so LODs keep their outline, texture layout and
+// skinning regions.
+class PMXMeshSimplifier {
+	const float *positions = nullptr;
+	uint32_t vertex_count = 0;
+	LocalVector<bool> locked;
+	LocalVector<int32_t> dominant_bones;
+	LocalVector<double> quadrics;
+
+	void _add_triangle_quadric(const int32_t *p_triangle);
+	double _collapse_error(uint32_t p_from, uint32_t p_to) const;
+	bool _flips(uint32_t p_from, uint32_t p_to, const LocalVector<int32_t> &p_indices, const LocalVector<uint32_t> &p_first_triangle, const LocalVector<uint32_t> &p_triangles) const;
+
+public:
+	// p_positions holds three floats and p_bones/p_weights four entries per
+	// vertex. The arrays must outlive the simplifier.
+	PMXMeshSimplifier(const float *p_positions, const int32_t *p_bones, const float *p_weights, uint32_t p_vertex_count, const LocalVector<int32_t> &p_indices);
+
+	// Collapses p_indices until no collapse stays under p_max_error, a
+	// distance in the units of the positions. Returns the largest error
+	// accepted.
+	float simplify(const LocalVector<int32_t> &p_indices, float p_max_error, LocalVector<int32_t> &r_indices);
+};
+
+#endif // PMX_MESH_SIMPLIFIER_H
@@ -29,4 +29,9 @@ void register_pmx_types() {
 }
 
 void unregister_pmx_types() {
-}
\ No newline at end of file
+#ifndef _3D_DISABLED
+	// Cached textures must be released while the rendering server still
+	// exists, not at static destruction.
+	PackedSceneMMDPMX::clear_texture_cache();
+#endif
+}
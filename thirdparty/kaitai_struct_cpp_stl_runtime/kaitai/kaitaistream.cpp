@@ -25,17 +25,32 @@
 #include <iostream>
 #include <vector>
 #include <stdexcept>
+#include <string.h>
 
 kaitai::kstream::kstream(std::istream* io) {
     m_io = io;
+    m_buf = NULL;
+    m_buf_size = 0;
+    m_buf_pos = 0;
     init();
 }
 
 kaitai::kstream::kstream(const std::string& data): m_io_str(data) {
     m_io = &m_io_str;
+    m_buf = NULL;
+    m_buf_size = 0;
+    m_buf_pos = 0;
     init();
 }
 
+kaitai::kstream::kstream(const char* data, uint64_t size) {
+    m_io = NULL;
+    m_buf = data;
+    m_buf_size = size;
+    m_buf_pos = 0;
+    align_to_byte();
+}
+
 void kaitai::kstream::init() {
     exceptions_enable();
     align_to_byte();
@@ -61,6 +76,9 @@ bool kaitai::kstream::is_eof() const {
     if (m_bits_left > 0) {
         return false;
     }
+    if (m_buf) {
+        return m_buf_pos >= m_buf_size;
+    }
     char t;
     m_io->exceptions(
         std::istream::badbit
@@ -78,14 +96,27 @@ bool kaitai::kstream::is_eof() const {
 }
 
 void kaitai::kstream::seek(uint64_t pos) {
+    if (m_buf) {
+        if (pos > m_buf_size) {
+            throw std::ios_base::failure("seek: position is past the end of the buffer");
+        }
+        m_buf_pos = pos;
+        return;
+    }
     m_io->seekg(pos);
 }
 
 uint64_t kaitai::kstream::pos() {
+    if (m_buf) {
+        return m_buf_pos;
+    }
     return m_io->tellg();
 }
 
 uint64_t kaitai::kstream::size() {
+    if (m_buf) {
+        return m_buf_size;
+    }
     std::iostream::pos_type cur_pos = m_io->tellg();
     m_io->seekg(0, std::ios::end);
     std::iostream::pos_type len = m_io->tellg();
@@ -103,7 +134,7 @@ uint64_t kaitai::kstream::size() {
 
 int8_t kaitai::kstream::read_s1() {
     char t;
-    m_io->get(t);
+    read_raw(&t, 1);
     return t;
 }
 
@@ -113,7 +144,7 @@ int8_t kaitai::kstream::read_s1() {
 
 int16_t kaitai::kstream::read_s2be() {
     int16_t t;
-    m_io->read(reinterpret_cast<char *>(&t), 2);
+    read_raw(reinterpret_cast<char *>(&t), 2);
 #if __BYTE_ORDER == __LITTLE_ENDIAN
     t = bswap_16(t);
 #endif
@@ -122,7 +153,7 @@ int16_t kaitai::kstream::read_s2be() {
 
 int32_t kaitai::kstream::read_s4be() {
     int32_t t;
-    m_io->read(reinterpret_cast<char *>(&t), 4);
+    read_raw(reinterpret_cast<char *>(&t), 4);
 #if __BYTE_ORDER == __LITTLE_ENDIAN
     t = bswap_32(t);
 #endif
@@ -131,7 +162,7 @@ int32_t kaitai::kstream::read_s4be() {
 
 int64_t kaitai::kstream::read_s8be() {
     int64_t t;
-    m_io->read(reinterpret_cast<char *>(&t), 8);
+    read_raw(reinterpret_cast<char *>(&t), 8);
 #if __BYTE_ORDER == __LITTLE_ENDIAN
     t = bswap_64(t);
 #endif
@@ -144,7 +175,7 @@ int64_t kaitai::kstream::read_s8be() {
 
 int16_t kaitai::kstream::read_s2le() {
     int16_t t;
-    m_io->read(reinterpret_cast<char *>(&t), 2);
+    read_raw(reinterpret_cast<char *>(&t), 2);
 #if __BYTE_ORDER == __BIG_ENDIAN
     t = bswap_16(t);
 #endif
@@ -153,7 +184,7 @@ int16_t kaitai::kstream::read_s2le() {
 
 int32_t kaitai::kstream::read_s4le() {
     int32_t t;
-    m_io->read(reinterpret_cast<char *>(&t), 4);
+    read_raw(reinterpret_cast<char *>(&t), 4);
 #if __BYTE_ORDER == __BIG_ENDIAN
     t = bswap_32(t);
 #endif
@@ -162,7 +193,7 @@ int32_t kaitai::kstream::read_s4le() {
 
 int64_t kaitai::kstream::read_s8le() {
     int64_t t;
-    m_io->read(reinterpret_cast<char *>(&t), 8);
+    read_raw(reinterpret_cast<char *>(&t), 8);
 #if __BYTE_ORDER == __BIG_ENDIAN
     t = bswap_64(t);
 #endif
@@ -175,7 +206,7 @@ int64_t kaitai::kstream::read_s8le() {
 
 uint8_t kaitai::kstream::read_u1() {
     char t;
-    m_io->get(t);
+    read_raw(&t, 1);
     return t;
 }
 
@@ -185,7 +216,7 @@ uint8_t kaitai::kstream::read_u1() {
 
 uint16_t kaitai::kstream::read_u2be() {
     uint16_t t;
-    m_io->read(reinterpret_cast<char *>(&t), 2);
+    read_raw(reinterpret_cast<char *>(&t), 2);
 #if __BYTE_ORDER == __LITTLE_ENDIAN
     t = bswap_16(t);
 #endif
@@ -194,7 +225,7 @@ uint16_t kaitai::kstream::read_u2be() {
 
 uint32_t kaitai::kstream::read_u4be() {
     uint32_t t;
-    m_io->read(reinterpret_cast<char *>(&t), 4);
+    read_raw(reinterpret_cast<char *>(&t), 4);
 #if __BYTE_ORDER == __LITTLE_ENDIAN
     t = bswap_32(t);
 #endif
@@ -203,7 +234,7 @@ uint32_t kaitai::kstream::read_u4be() {
 
 uint64_t kaitai::kstream::read_u8be() {
     uint64_t t;
-    m_io->read(reinterpret_cast<char *>(&t), 8);
+    read_raw(reinterpret_cast<char *>(&t), 8);
 #if __BYTE_ORDER == __LITTLE_ENDIAN
     t = bswap_64(t);
 #endif
@@ -216,7 +247,7 @@ uint64_t kaitai::kstream::read_u8be() {
 
 uint16_t kaitai::kstream::read_u2le() {
     uint16_t t;
-    m_io->read(reinterpret_cast<char *>(&t), 2);
+    read_raw(reinterpret_cast<char *>(&t), 2);
 #if __BYTE_ORDER == __BIG_ENDIAN
     t = bswap_16(t);
 #endif
@@ -225,7 +256,7 @@ uint16_t kaitai::kstream::read_u2le() {
 
 uint32_t kaitai::kstream::read_u4le() {
     uint32_t t;
-    m_io->read(reinterpret_cast<char *>(&t), 4);
+    read_raw(reinterpret_cast<char *>(&t), 4);
 #if __BYTE_ORDER == __BIG_ENDIAN
     t = bswap_32(t);
 #endif
@@ -234,7 +265,7 @@ uint32_t kaitai::kstream::read_u4le() {
 
 uint64_t kaitai::kstream::read_u8le() {
     uint64_t t;
-    m_io->read(reinterpret_cast<char *>(&t), 8);
+    read_raw(reinterpret_cast<char *>(&t), 8);
 #if __BYTE_ORDER == __BIG_ENDIAN
     t = bswap_64(t);
 #endif
@@ -251,7 +282,7 @@ uint64_t kaitai::kstream::read_u8le() {
 
 float kaitai::kstream::read_f4be() {
     uint32_t t;
-    m_io->read(reinterpret_cast<char *>(&t), 4);
+    read_raw(reinterpret_cast<char *>(&t), 4);
 #if __BYTE_ORDER == __LITTLE_ENDIAN
     t = bswap_32(t);
 #endif
@@ -260,7 +291,7 @@ float kaitai::kstream::read_f4be() {
 
 double kaitai::kstream::read_f8be() {
     uint64_t t;
-    m_io->read(reinterpret_cast<char *>(&t), 8);
+    read_raw(reinterpret_cast<char *>(&t), 8);
 #if __BYTE_ORDER == __LITTLE_ENDIAN
     t = bswap_64(t);
 #endif
@@ -273,7 +304,7 @@ double kaitai::kstream::read_f8be() {
 
 float kaitai::kstream::read_f4le() {
     uint32_t t;
-    m_io->read(reinterpret_cast<char *>(&t), 4);
+    read_raw(reinterpret_cast<char *>(&t), 4);
 #if __BYTE_ORDER == __BIG_ENDIAN
     t = bswap_32(t);
 #endif
@@ -282,7 +313,7 @@ float kaitai::kstream::read_f4le() {
 
 double kaitai::kstream::read_f8le() {
     uint64_t t;
-    m_io->read(reinterpret_cast<char *>(&t), 8);
+    read_raw(reinterpret_cast<char *>(&t), 8);
 #if __BYTE_ORDER == __BIG_ENDIAN
     t = bswap_64(t);
 #endif
@@ -308,7 +339,7 @@ uint64_t kaitai::kstream::read_bits_int_be(int n) {
         if (bytes_needed > 8)
             throw std::runtime_error("read_bits_int: more than 8 bytes requested");
         char buf[8];
-        m_io->read(buf, bytes_needed);
+        read_raw(buf, bytes_needed);
         for (int i = 0; i < bytes_needed; i++) {
             uint8_t b = buf[i];
             m_bits <<= 8;
@@ -347,7 +378,7 @@ uint64_t kaitai::kstream::read_bits_int_le(int n) {
         if (bytes_needed > 8)
             throw std::runtime_error("read_bits_int_le: more than 8 bytes requested");
         char buf[8];
-        m_io->read(buf, bytes_needed);
+        read_raw(buf, bytes_needed);
         for (int i = 0; i < bytes_needed; i++) {
             uint8_t b = buf[i];
             m_bits |= (static_cast<uint64_t>(b) << m_bits_left);
@@ -366,6 +397,10 @@ uint64_t kaitai::kstream::read_bits_int_le(int n) {
     return res;
 }
 
+void kaitai::kstream::throw_eof() const {
+    throw std::ios_base::failure("read: requested past the end of the buffer");
+}
+
 uint64_t kaitai::kstream::get_mask_ones(int n) {
     if (n == 64) {
         return 0xFFFFFFFFFFFFFFFF;
@@ -379,14 +414,23 @@ uint64_t kaitai::kstream::get_mask_ones(int n) {
 // ========================================================================
 
 std::string kaitai::kstream::read_bytes(std::streamsize len) {
-    std::vector<char> result(len);
-
     // NOTE: streamsize type is signed, negative values are only *supposed* to not be used.
     // http://en.cppreference.com/w/cpp/io/streamsize
     if (len < 0) {
         throw std::runtime_error("read_bytes: requested a negative amount");
     }
 
+    if (m_buf) {
+        if (static_cast<uint64_t>(len) > m_buf_size - m_buf_pos) {
+            throw_eof();
+        }
+        const char* begin = m_buf + m_buf_pos;
+        m_buf_pos += len;
+        return std::string(begin, begin + len);
+    }
+
+    std::vector<char> result(len);
+
     if (len > 0) {
         m_io->read(&result[0], len);
     }
@@ -394,7 +438,25 @@ std::string kaitai::kstream::read_bytes(std::streamsize len) {
     return std::string(result.begin(), result.end());
 }
 
+const char* kaitai::kstream::read_bytes_view(uint64_t len) {
+    if (!m_buf) {
+        return NULL;
+    }
+    if (len > m_buf_size - m_buf_pos) {
+        throw_eof();
+    }
+    const char* begin = m_buf + m_buf_pos;
+    m_buf_pos += len;
+    return begin;
+}
+
 std::string kaitai::kstream::read_bytes_full() {
+    if (m_buf) {
+        const char* begin = m_buf + m_buf_pos;
+        m_buf_pos = m_buf_size;
+        return std::string(begin, m_buf + m_buf_size);
+    }
+
     std::iostream::pos_type p1 = m_io->tellg();
     m_io->seekg(0, std::ios::end);
     std::iostream::pos_type p2 = m_io->tellg();
@@ -413,6 +475,23 @@ std::string kaitai::kstream::read_bytes_full() {
 
 std::string kaitai::kstream::read_bytes_term(char term, bool include, bool consume, bool eos_error) {
     std::string result;
+    if (m_buf) {
+        const char* begin = m_buf + m_buf_pos;
+        const char* end = m_buf + m_buf_size;
+        const char* found = static_cast<const char*>(memchr(begin, term, end - begin));
+        if (!found) {
+            if (eos_error) {
+                throw std::runtime_error("read_bytes_term: encountered EOF");
+            }
+            m_buf_pos = m_buf_size;
+            return std::string(begin, end);
+        }
+        result.assign(begin, found);
+        if (include)
+            result.push_back(term);
+        m_buf_pos = (found - m_buf) + (consume ? 1 : 0);
+        return result;
+    }
     std::getline(*m_io, result, term);
     if (m_io->eof()) {
         // encountered EOF
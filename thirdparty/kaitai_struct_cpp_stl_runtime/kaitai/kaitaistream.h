@@ -7,6 +7,7 @@
 #include <istream>
 #include <sstream>
 #include <stdint.h>
+#include <string.h>
 #include <sys/types.h>
 
 namespace kaitai {
@@ -43,6 +44,16 @@ public:
      */
     kstream(const std::string& data);
 
+    /**
+     * Constructs new Kaitai Stream object reading straight from a memory
+     * buffer, e.g. a whole file loaded or mapped by the caller. The buffer
+     * is not copied and must outlive the stream. Reads are bounds-checked
+     * against the buffer and do not go through std::istream at all.
+     * \param data pointer to the first byte of the buffer
+     * \param size size of the buffer in bytes
+     */
+    kstream(const char* data, uint64_t size);
+
     void close();
 
     /** @name Stream positioning */
@@ -158,6 +169,20 @@ public:
     //@{
 
     std::string read_bytes(std::streamsize len);
+
+    /**
+     * Returns a pointer to the next `len` bytes and advances past them,
+     * without copying. Only memory-backed streams can do this; streams over
+     * a std::istream return NULL and do not move, so callers must fall back
+     * to read_bytes().
+     */
+    const char* read_bytes_view(uint64_t len);
+
+    /**
+     * Start of the caller-owned buffer of a memory-backed stream, or NULL for
+     * streams over a std::istream.
+     */
+    const char* buffer() const { return m_buf; }
     std::string read_bytes_full();
     std::string read_bytes_term(char term, bool include, bool consume, bool eos_error);
     std::string ensure_fixed_contents(std::string expected);
@@ -252,11 +277,27 @@ public:
 private:
     std::istream* m_io;
     std::istringstream m_io_str;
+    const char* m_buf;
+    uint64_t m_buf_size;
+    uint64_t m_buf_pos;
     int m_bits_left;
     uint64_t m_bits;
 
     void init();
     void exceptions_enable() const;
+    void throw_eof() const;
+
+    void read_raw(char* dst, uint64_t len) {
+        if (m_buf) {
+            if (len > m_buf_size - m_buf_pos) {
+                throw_eof();
+            }
+            memcpy(dst, m_buf + m_buf_pos, len);
+            m_buf_pos += len;
+        } else {
+            m_io->read(dst, len);
+        }
+    }
 
     static uint64_t get_mask_ones(int n);
 
@@ -0,0 +1,85 @@
+#include <kaitai/kaitaistruct.h>
+
+#include <new>
+
+namespace {
+
+// Every object is prefixed with the arena it came from (or nullptr). The
+// header is padded to keep the object itself at the strictest fundamental
+// alignment.
+const size_t KSTRUCT_HEADER_SIZE = alignof(std::max_align_t);
+
+size_t align_up(size_t size) {
+    return (size + KSTRUCT_HEADER_SIZE - 1) & ~(KSTRUCT_HEADER_SIZE - 1);
+}
+
+thread_local kaitai::kstruct_arena* current_arena = nullptr;
+
+}
+
+kaitai::kstruct_arena::kstruct_arena(size_t block_size) {
+    m_cursor = nullptr;
+    m_left = 0;
+    m_block_size = align_up(block_size);
+    m_bytes_used = 0;
+}
+
+kaitai::kstruct_arena::~kstruct_arena() {
+    for (size_t i = 0; i < m_blocks.size(); i++) {
+        ::operator delete(m_blocks[i]);
+    }
+}
+
+void* kaitai::kstruct_arena::allocate(size_t size) {
+    size = align_up(size);
+    if (size > m_left) {
+        if (size > m_block_size / 4) {
+            // Oversized requests get a block of their own so they do not
+            // waste the rest of the current one.
+            char* block = static_cast<char*>(::operator new(size));
+            m_blocks.push_back(block);
+            m_bytes_used += size;
+            return block;
+        }
+        char* block = static_cast<char*>(::operator new(m_block_size));
+        m_blocks.push_back(block);
+        m_cursor = block;
+        m_left = m_block_size;
+    }
+    char* ptr = m_cursor;
+    m_cursor += size;
+    m_left -= size;
+    m_bytes_used += size;
+    return ptr;
+}
+
+kaitai::kstruct_arena* kaitai::kstruct_arena::current() {
+    return current_arena;
+}
+
+kaitai::kstruct_arena::scope::scope(kstruct_arena* arena) {
+    m_previous = current_arena;
+    current_arena = arena;
+}
+
+kaitai::kstruct_arena::scope::~scope() {
+    current_arena = m_previous;
+}
+
+void* kaitai::kstruct::operator new(size_t size) {
+    kstruct_arena* arena = current_arena;
+    size_t total = KSTRUCT_HEADER_SIZE + size;
+    char* block = static_cast<char*>(arena ? arena->allocate(total) : ::operator new(total));
+    *reinterpret_cast<kstruct_arena**>(block) = arena;
+    return block + KSTRUCT_HEADER_SIZE;
+}
+
+void kaitai::kstruct::operator delete(void* ptr) {
+    if (!ptr) {
+        return;
+    }
+    char* block = static_cast<char*>(ptr) - KSTRUCT_HEADER_SIZE;
+    if (!*reinterpret_cast<kstruct_arena**>(block)) {
+        ::operator delete(block);
+    }
+}
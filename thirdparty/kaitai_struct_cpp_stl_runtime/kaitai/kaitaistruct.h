@@ -3,12 +3,73 @@
 
 #include <kaitai/kaitaistream.h>
 
+#include <cstddef>
+#include <vector>
+
 namespace kaitai {
 
+/**
+ * Monotonic allocator for kstruct objects.
+ *
+ * While a kstruct_arena::scope is active on a thread, every kstruct created
+ * on that thread is carved out of the arena's blocks and deleting it only
+ * runs its destructor. The blocks are released together when the arena is
+ * destroyed, so the arena must outlive every object allocated from it.
+ * An arena is not thread-safe; give each thread its own.
+ */
+class kstruct_arena {
+public:
+    explicit kstruct_arena(size_t block_size = 256 * 1024);
+    ~kstruct_arena();
+
+    void* allocate(size_t size);
+
+    /** Number of blocks obtained from the global allocator so far. */
+    size_t block_count() const { return m_blocks.size(); }
+    /** Bytes handed out so far, including per-object headers and padding. */
+    size_t bytes_used() const { return m_bytes_used; }
+
+    /**
+     * Makes an arena the current one for this thread until the scope ends.
+     * Scopes nest; passing nullptr switches back to the global heap.
+     */
+    class scope {
+    public:
+        explicit scope(kstruct_arena* arena);
+        ~scope();
+
+    private:
+        kstruct_arena* m_previous;
+
+        scope(const scope&);
+        scope& operator=(const scope&);
+    };
+
+    static kstruct_arena* current();
+
+private:
+    std::vector<char*> m_blocks;
+    char* m_cursor;
+    size_t m_left;
+    size_t m_block_size;
+    size_t m_bytes_used;
+
+    kstruct_arena(const kstruct_arena&);
+    kstruct_arena& operator=(const kstruct_arena&);
+};
+
 class kstruct {
 public:
     kstruct(kstream *_io) { m__io = _io; }
     virtual ~kstruct() {}
+
+    /**
+     * Allocates from the thread's current kstruct_arena if there is one,
+     * otherwise from the global heap. Each object is prefixed with the
+     * arena it came from so delete knows whether to free it.
+     */
+    static void* operator new(size_t size);
+    static void operator delete(void* ptr);
 protected:
     kstream *m__io;
 public:
@@ -3,89 +3,898 @@
 #include "mmd_pmx.h"
 #include "kaitai/exceptions.h"
 
+#include <cstring>
+#include <string>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define MMD_PMX_WIDEN_SSE2
+#elif defined(__ARM_NEON) && defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+#include <arm_neon.h>
+#define MMD_PMX_WIDEN_NEON
+#endif
+
 mmd_pmx_t::mmd_pmx_t(kaitai::kstream* p__io, kaitai::kstruct* p__parent, mmd_pmx_t* p__root) : kaitai::kstruct(p__io) {
     m__parent = p__parent;
     m__root = this;
+    _init(READ_MODE_ALL, (1u << SECTION_COUNT) - 1);
+}
+
+mmd_pmx_t::mmd_pmx_t(kaitai::kstream* p__io, read_mode_t p_read_mode, uint32_t p_section_mask) : kaitai::kstruct(p__io) {
+    m__parent = nullptr;
+    m__root = this;
+    _init(p_read_mode, p_section_mask);
+}
+
+void mmd_pmx_t::_init(read_mode_t p_read_mode, uint32_t p_section_mask) {
+    for (int i = 0; i <= SECTION_COUNT; i++) {
+        m__arenas[i] = std::unique_ptr<kaitai::kstruct_arena>(new kaitai::kstruct_arena());
+        m__section_offsets[i] = 0;
+    }
+    for (int i = 0; i < SECTION_COUNT; i++) {
+        m__section_read[i] = false;
+    }
+    m__sections_located = 0;
+    m_string_encoding = 0;
     m_header = nullptr;
+    m_vertex_count = 0;
     m_vertices = nullptr;
-    m_faces = nullptr;
+    m_face_vertex_count = 0;
+    m_face_indices = nullptr;
+    m_texture_count = 0;
     m_textures = nullptr;
+    m_material_count = 0;
     m_materials = nullptr;
+    m_bone_count = 0;
     m_bones = nullptr;
+    m_morph_count = 0;
     m_morphs = nullptr;
+    m_frame_count = 0;
     m_frames = nullptr;
+    m_rigid_body_count = 0;
     m_rigid_bodies = nullptr;
+    m_joint_count = 0;
     m_joints = nullptr;
-    _read();
+    uint64_t l_header_offset = m__io->pos();
+    {
+        kaitai::kstruct_arena::scope arena_scope(m__arenas[SECTION_COUNT].get());
+        m_header = std::unique_ptr<header_t>(new header_t(m__io, this, m__root));
+    }
+    // Streams over a std::istream cannot be split, so they are read in full.
+    if (p_read_mode == READ_MODE_DEFERRED && m__io->buffer()) {
+        _scan_sections(l_header_offset, p_section_mask);
+    } else {
+        _read();
+    }
 }
 
 void mmd_pmx_t::_read() {
-    m_header = std::unique_ptr<header_t>(new header_t(m__io, this, m__root));
-    m_vertex_count = m__io->read_u4le();
-    int l_vertices = vertex_count();
-    m_vertices = std::unique_ptr<std::vector<std::unique_ptr<vertex_t>>>(new std::vector<std::unique_ptr<vertex_t>>());
-    m_vertices->reserve(l_vertices);
-    for (int i = 0; i < l_vertices; i++) {
-        m_vertices->push_back(std::move(std::unique_ptr<vertex_t>(new vertex_t(m__io, this, m__root))));
+    for (int i = 0; i < SECTION_COUNT; i++) {
+        m__section_offsets[i] = m__io->pos();
+        kaitai::kstruct_arena::scope arena_scope(m__arenas[i].get());
+        _read_section(static_cast<section_t>(i), m__io);
+        m__section_read[i] = true;
     }
-    m_face_vertex_count = m__io->read_u4le();
-    int l_faces = (face_vertex_count() / 3);
-    m_faces = std::unique_ptr<std::vector<std::unique_ptr<face_t>>>(new std::vector<std::unique_ptr<face_t>>());
-    m_faces->reserve(l_faces);
-    for (int i = 0; i < l_faces; i++) {
-        m_faces->push_back(std::move(std::unique_ptr<face_t>(new face_t(m__io, this, m__root))));
-    }
-    m_texture_count = m__io->read_u4le();
-    int l_textures = texture_count();
-    m_textures = std::unique_ptr<std::vector<std::unique_ptr<texture_t>>>(new std::vector<std::unique_ptr<texture_t>>());
-    m_textures->reserve(l_textures);
-    for (int i = 0; i < l_textures; i++) {
-        m_textures->push_back(std::move(std::unique_ptr<texture_t>(new texture_t(m__io, this, m__root))));
-    }
-    m_material_count = m__io->read_u4le();
-    int l_materials = material_count();
-    m_materials = std::unique_ptr<std::vector<std::unique_ptr<material_t>>>(new std::vector<std::unique_ptr<material_t>>());
-    m_materials->reserve(l_materials);
-    for (int i = 0; i < l_materials; i++) {
-        m_materials->push_back(std::move(std::unique_ptr<material_t>(new material_t(m__io, this, m__root))));
-    }
-    m_bone_count = m__io->read_u4le();
-    int l_bones = bone_count();
-    m_bones = std::unique_ptr<std::vector<std::unique_ptr<bone_t>>>(new std::vector<std::unique_ptr<bone_t>>());
-    m_bones->reserve(l_bones);
-    for (int i = 0; i < l_bones; i++) {
-        m_bones->push_back(std::move(std::unique_ptr<bone_t>(new bone_t(m__io, this, m__root))));
-    }
-    m_morph_count = m__io->read_u4le();
-    int l_morphs = morph_count();
-    m_morphs = std::unique_ptr<std::vector<std::unique_ptr<morph_t>>>(new std::vector<std::unique_ptr<morph_t>>());
-    m_morphs->reserve(l_morphs);
-    for (int i = 0; i < l_morphs; i++) {
-        m_morphs->push_back(std::move(std::unique_ptr<morph_t>(new morph_t(m__io, this, m__root))));
-    }
-    m_frame_count = m__io->read_u4le();
-    int l_frames = frame_count();
-    m_frames = std::unique_ptr<std::vector<std::unique_ptr<frame_t>>>(new std::vector<std::unique_ptr<frame_t>>());
-    m_frames->reserve(l_frames);
-    for (int i = 0; i < l_frames; i++) {
-        m_frames->push_back(std::move(std::unique_ptr<frame_t>(new frame_t(m__io, this, m__root))));
-    }
-    m_rigid_body_count = m__io->read_u4le();
-    int l_rigid_bodies = rigid_body_count();
-    m_rigid_bodies = std::unique_ptr<std::vector<std::unique_ptr<rigid_body_t>>>(new std::vector<std::unique_ptr<rigid_body_t>>());
-    m_rigid_bodies->reserve(l_rigid_bodies);
-    for (int i = 0; i < l_rigid_bodies; i++) {
-        m_rigid_bodies->push_back(std::move(std::unique_ptr<rigid_body_t>(new rigid_body_t(m__io, this, m__root))));
-    }
-    m_joint_count = m__io->read_u4le();
-    int l_joints = joint_count();
-    m_joints = std::unique_ptr<std::vector<std::unique_ptr<joint_t>>>(new std::vector<std::unique_ptr<joint_t>>());
-    m_joints->reserve(l_joints);
-    for (int i = 0; i < l_joints; i++) {
-        m_joints->push_back(std::move(std::unique_ptr<joint_t>(new joint_t(m__io, this, m__root))));
+    m__section_offsets[SECTION_COUNT] = m__io->pos();
+    m__sections_located = SECTION_COUNT;
+}
+
+void mmd_pmx_t::read_section(section_t p_section) {
+    if (m__section_read[p_section]) {
+        return;
+    }
+    if (!section_located(p_section)) {
+        throw std::out_of_range("read_section: section was not located");
+    }
+    uint64_t l_start = m__section_offsets[p_section];
+    uint64_t l_size = m__section_offsets[p_section + 1] - l_start;
+    m__section_ios[p_section] = std::unique_ptr<kaitai::kstream>(new kaitai::kstream(m__io->buffer() + l_start, l_size));
+    kaitai::kstruct_arena::scope arena_scope(m__arenas[p_section].get());
+    _read_section(p_section, m__section_ios[p_section].get());
+    m__section_read[p_section] = true;
+}
+
+void mmd_pmx_t::_read_section(section_t p_section, kaitai::kstream* p__io) {
+    switch (p_section) {
+    case SECTION_VERTICES: {
+        m_vertex_count = p__io->read_u4le();
+        _read_vertices(p__io);
+        break;
+    }
+    case SECTION_FACES: {
+        m_face_vertex_count = p__io->read_u4le();
+        _read_faces(p__io);
+        break;
+    }
+    case SECTION_TEXTURES: {
+        m_texture_count = p__io->read_u4le();
+        int l_textures = texture_count();
+        m_textures = std::unique_ptr<std::vector<std::unique_ptr<texture_t>>>(new std::vector<std::unique_ptr<texture_t>>());
+        m_textures->reserve(l_textures);
+        for (int i = 0; i < l_textures; i++) {
+            m_textures->push_back(std::move(std::unique_ptr<texture_t>(new texture_t(p__io, this, m__root))));
+        }
+        break;
+    }
+    case SECTION_MATERIALS: {
+        m_material_count = p__io->read_u4le();
+        int l_materials = material_count();
+        m_materials = std::unique_ptr<std::vector<std::unique_ptr<material_t>>>(new std::vector<std::unique_ptr<material_t>>());
+        m_materials->reserve(l_materials);
+        for (int i = 0; i < l_materials; i++) {
+            m_materials->push_back(std::move(std::unique_ptr<material_t>(new material_t(p__io, this, m__root))));
+        }
+        break;
+    }
+    case SECTION_BONES: {
+        m_bone_count = p__io->read_u4le();
+        int l_bones = bone_count();
+        m_bones = std::unique_ptr<std::vector<std::unique_ptr<bone_t>>>(new std::vector<std::unique_ptr<bone_t>>());
+        m_bones->reserve(l_bones);
+        for (int i = 0; i < l_bones; i++) {
+            m_bones->push_back(std::move(std::unique_ptr<bone_t>(new bone_t(p__io, this, m__root))));
+        }
+        break;
+    }
+    case SECTION_MORPHS: {
+        m_morph_count = p__io->read_u4le();
+        int l_morphs = morph_count();
+        m_morphs = std::unique_ptr<std::vector<std::unique_ptr<morph_t>>>(new std::vector<std::unique_ptr<morph_t>>());
+        m_morphs->reserve(l_morphs);
+        for (int i = 0; i < l_morphs; i++) {
+            m_morphs->push_back(std::move(std::unique_ptr<morph_t>(new morph_t(p__io, this, m__root))));
+        }
+        break;
+    }
+    case SECTION_FRAMES: {
+        m_frame_count = p__io->read_u4le();
+        int l_frames = frame_count();
+        m_frames = std::unique_ptr<std::vector<std::unique_ptr<frame_t>>>(new std::vector<std::unique_ptr<frame_t>>());
+        m_frames->reserve(l_frames);
+        for (int i = 0; i < l_frames; i++) {
+            m_frames->push_back(std::move(std::unique_ptr<frame_t>(new frame_t(p__io, this, m__root))));
+        }
+        break;
+    }
+    case SECTION_RIGID_BODIES: {
+        m_rigid_body_count = p__io->read_u4le();
+        int l_rigid_bodies = rigid_body_count();
+        m_rigid_bodies = std::unique_ptr<std::vector<std::unique_ptr<rigid_body_t>>>(new std::vector<std::unique_ptr<rigid_body_t>>());
+        m_rigid_bodies->reserve(l_rigid_bodies);
+        for (int i = 0; i < l_rigid_bodies; i++) {
+            m_rigid_bodies->push_back(std::move(std::unique_ptr<rigid_body_t>(new rigid_body_t(p__io, this, m__root))));
+        }
+        break;
+    }
+    case SECTION_JOINTS: {
+        m_joint_count = p__io->read_u4le();
+        int l_joints = joint_count();
+        m_joints = std::unique_ptr<std::vector<std::unique_ptr<joint_t>>>(new std::vector<std::unique_ptr<joint_t>>());
+        m_joints->reserve(l_joints);
+        for (int i = 0; i < l_joints; i++) {
+            m_joints->push_back(std::move(std::unique_ptr<joint_t>(new joint_t(p__io, this, m__root))));
+        }
+        break;
+    }
+    default:
+        break;
     }
 }
 
+void mmd_pmx_t::_read_vertices(kaitai::kstream* p__io) {
+    _allocate_vertices();
+    _read_vertex_range(p__io, 0, vertex_count(), m_vertices->sdef_vertices, m_vertices->sdef_params);
+}
+
+void mmd_pmx_t::_allocate_vertices() {
+    size_t l_vertices = vertex_count();
+    size_t l_additional_uvs = header()->additional_uv_count() * 4;
+    m_vertices = std::unique_ptr<vertex_table_t>(new vertex_table_t());
+    vertex_table_t* t = m_vertices.get();
+    t->positions.resize(l_vertices * 3);
+    t->normals.resize(l_vertices * 3);
+    t->uvs.resize(l_vertices * 2);
+    t->additional_uvs.resize(l_vertices * l_additional_uvs);
+    t->weight_types.resize(l_vertices);
+    t->bone_indices.resize(l_vertices * 4, -1);
+    t->weights.resize(l_vertices * 4, 0.0f);
+    t->edge_ratios.resize(l_vertices);
+}
+
+void mmd_pmx_t::_read_vertex_range(kaitai::kstream* p__io, size_t p_begin, size_t p_end, std::vector<uint32_t>& r_sdef_vertices, std::vector<float>& r_sdef_params) {
+    size_t l_additional_uvs = header()->additional_uv_count() * 4;
+    uint8_t l_bone_index_size = header()->bone_index_size();
+    vertex_table_t* t = m_vertices.get();
+    for (size_t i = p_begin; i < p_end; i++) {
+        float* position = &t->positions[i * 3];
+        position[0] = p__io->read_f4le();
+        position[1] = p__io->read_f4le();
+        position[2] = p__io->read_f4le();
+        float* normal = &t->normals[i * 3];
+        normal[0] = p__io->read_f4le();
+        normal[1] = p__io->read_f4le();
+        normal[2] = p__io->read_f4le();
+        float* uv = &t->uvs[i * 2];
+        uv[0] = p__io->read_f4le();
+        uv[1] = p__io->read_f4le();
+        for (size_t j = 0; j < l_additional_uvs; j++) {
+            t->additional_uvs[i * l_additional_uvs + j] = p__io->read_f4le();
+        }
+        uint8_t type = p__io->read_u1();
+        t->weight_types[i] = type;
+        int32_t* bones = &t->bone_indices[i * 4];
+        float* weights = &t->weights[i * 4];
+        switch (type) {
+        case mmd_pmx_t::BONE_TYPE_BDEF1: {
+            bones[0] = _read_signed_index(p__io, l_bone_index_size);
+            weights[0] = 1.0f;
+            break;
+        }
+        case mmd_pmx_t::BONE_TYPE_BDEF2:
+        case mmd_pmx_t::BONE_TYPE_SDEF: {
+            bones[0] = _read_signed_index(p__io, l_bone_index_size);
+            bones[1] = _read_signed_index(p__io, l_bone_index_size);
+            weights[0] = p__io->read_f4le();
+            weights[1] = 1.0f - weights[0];
+            if (type == mmd_pmx_t::BONE_TYPE_SDEF) {
+                r_sdef_vertices.push_back(i);
+                for (int j = 0; j < 9; j++) {
+                    r_sdef_params.push_back(p__io->read_f4le());
+                }
+            }
+            break;
+        }
+        case mmd_pmx_t::BONE_TYPE_BDEF4:
+        case mmd_pmx_t::BONE_TYPE_QDEF: {
+            for (int j = 0; j < 4; j++) {
+                bones[j] = _read_signed_index(p__io, l_bone_index_size);
+            }
+            for (int j = 0; j < 4; j++) {
+                weights[j] = p__io->read_f4le();
+            }
+            break;
+        }
+        }
+        t->edge_ratios[i] = p__io->read_f4le();
+    }
+}
+
+uint32_t mmd_pmx_t::begin_vertex_chunks() {
+    if (m__section_read[SECTION_VERTICES] || !section_located(SECTION_VERTICES)) {
+        return 0;
+    }
+    kaitai::kstream l_io(m__io->buffer() + m__section_offsets[SECTION_VERTICES], 4);
+    m_vertex_count = l_io.read_u4le();
+    _allocate_vertices();
+    return static_cast<uint32_t>(m__vertex_chunks.size());
+}
+
+void mmd_pmx_t::read_vertex_chunk(uint32_t p_chunk) {
+    vertex_chunk_t& l_chunk = m__vertex_chunks[p_chunk];
+    uint64_t l_end = p_chunk + 1 < m__vertex_chunks.size() ? m__vertex_chunks[p_chunk + 1].offset : m__section_offsets[SECTION_VERTICES + 1];
+    size_t l_begin_vertex = static_cast<size_t>(p_chunk) * VERTEX_CHUNK_SIZE;
+    size_t l_end_vertex = l_begin_vertex + VERTEX_CHUNK_SIZE;
+    if (l_end_vertex > vertex_count()) {
+        l_end_vertex = vertex_count();
+    }
+    kaitai::kstream l_io(m__io->buffer() + l_chunk.offset, l_end - l_chunk.offset);
+    _read_vertex_range(&l_io, l_begin_vertex, l_end_vertex, l_chunk.sdef_vertices, l_chunk.sdef_params);
+}
+
+void mmd_pmx_t::end_vertex_chunks() {
+    vertex_table_t* t = m_vertices.get();
+    if (!t || m__section_read[SECTION_VERTICES]) {
+        return;
+    }
+    size_t l_sdef_vertices = 0;
+    for (size_t i = 0; i < m__vertex_chunks.size(); i++) {
+        l_sdef_vertices += m__vertex_chunks[i].sdef_vertices.size();
+    }
+    t->sdef_vertices.reserve(l_sdef_vertices);
+    t->sdef_params.reserve(l_sdef_vertices * 9);
+    for (size_t i = 0; i < m__vertex_chunks.size(); i++) {
+        vertex_chunk_t& l_chunk = m__vertex_chunks[i];
+        t->sdef_vertices.insert(t->sdef_vertices.end(), l_chunk.sdef_vertices.begin(), l_chunk.sdef_vertices.end());
+        t->sdef_params.insert(t->sdef_params.end(), l_chunk.sdef_params.begin(), l_chunk.sdef_params.end());
+    }
+    m__vertex_chunks.clear();
+    m__section_read[SECTION_VERTICES] = true;
+}
+
+namespace {
+template <typename T>
+void append_copy(std::vector<T>& r_values, size_t p_begin, size_t p_count) {
+    // push_back of an element of the same vector is safe across
+    // reallocation; inserting a range of it is not.
+    for (size_t i = 0; i < p_count; i++) {
+        r_values.push_back(r_values[p_begin + i]);
+    }
+}
+}
+
+uint32_t mmd_pmx_t::duplicate_vertex(uint32_t p_vertex) {
+    vertex_table_t* t = m_vertices.get();
+    if (!t || !m__section_read[SECTION_VERTICES] || p_vertex >= m_vertex_count) {
+        throw std::out_of_range("duplicate_vertex");
+    }
+    size_t l_additional_uvs = header()->additional_uv_count() * 4;
+    append_copy(t->positions, p_vertex * 3, 3);
+    append_copy(t->normals, p_vertex * 3, 3);
+    append_copy(t->uvs, p_vertex * 2, 2);
+    append_copy(t->additional_uvs, p_vertex * l_additional_uvs, l_additional_uvs);
+    append_copy(t->weight_types, p_vertex, 1);
+    append_copy(t->bone_indices, p_vertex * 4, 4);
+    append_copy(t->weights, p_vertex * 4, 4);
+    append_copy(t->edge_ratios, p_vertex, 1);
+    return m_vertex_count++;
+}
+
+// Widens `count` little-endian unsigned indices of `size` bytes each to
+// uint32_t. The SIMD paths zero-extend 16 indices per iteration.
+static void widen_indices(const uint8_t* src, uint8_t size, size_t count, uint32_t* dst) {
+    size_t i = 0;
+    switch (size) {
+    case 1: {
+#if defined(MMD_PMX_WIDEN_SSE2)
+        const __m128i zero = _mm_setzero_si128();
+        for (; i + 16 <= count; i += 16) {
+            __m128i bytes = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i));
+            __m128i lo = _mm_unpacklo_epi8(bytes, zero);
+            __m128i hi = _mm_unpackhi_epi8(bytes, zero);
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + i), _mm_unpacklo_epi16(lo, zero));
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + i + 4), _mm_unpackhi_epi16(lo, zero));
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + i + 8), _mm_unpacklo_epi16(hi, zero));
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + i + 12), _mm_unpackhi_epi16(hi, zero));
+        }
+#elif defined(MMD_PMX_WIDEN_NEON)
+        for (; i + 16 <= count; i += 16) {
+            uint8x16_t bytes = vld1q_u8(src + i);
+            uint16x8_t lo = vmovl_u8(vget_low_u8(bytes));
+            uint16x8_t hi = vmovl_u8(vget_high_u8(bytes));
+            vst1q_u32(dst + i, vmovl_u16(vget_low_u16(lo)));
+            vst1q_u32(dst + i + 4, vmovl_u16(vget_high_u16(lo)));
+            vst1q_u32(dst + i + 8, vmovl_u16(vget_low_u16(hi)));
+            vst1q_u32(dst + i + 12, vmovl_u16(vget_high_u16(hi)));
+        }
+#endif
+        for (; i < count; i++) {
+            dst[i] = src[i];
+        }
+        break;
+    }
+    case 2: {
+#if defined(MMD_PMX_WIDEN_SSE2)
+        const __m128i zero = _mm_setzero_si128();
+        for (; i + 16 <= count; i += 16) {
+            __m128i lo = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i * 2));
+            __m128i hi = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i * 2 + 16));
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + i), _mm_unpacklo_epi16(lo, zero));
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + i + 4), _mm_unpackhi_epi16(lo, zero));
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + i + 8), _mm_unpacklo_epi16(hi, zero));
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + i + 12), _mm_unpackhi_epi16(hi, zero));
+        }
+#elif defined(MMD_PMX_WIDEN_NEON)
+        for (; i + 16 <= count; i += 16) {
+            uint16x8_t lo = vreinterpretq_u16_u8(vld1q_u8(src + i * 2));
+            uint16x8_t hi = vreinterpretq_u16_u8(vld1q_u8(src + i * 2 + 16));
+            vst1q_u32(dst + i, vmovl_u16(vget_low_u16(lo)));
+            vst1q_u32(dst + i + 4, vmovl_u16(vget_high_u16(lo)));
+            vst1q_u32(dst + i + 8, vmovl_u16(vget_low_u16(hi)));
+            vst1q_u32(dst + i + 12, vmovl_u16(vget_high_u16(hi)));
+        }
+#endif
+        for (; i < count; i++) {
+            dst[i] = src[i * 2] | (src[i * 2 + 1] << 8);
+        }
+        break;
+    }
+    case 4: {
+        for (; i < count; i++) {
+            dst[i] = src[i * 4] | (src[i * 4 + 1] << 8) | (src[i * 4 + 2] << 16) | (static_cast<uint32_t>(src[i * 4 + 3]) << 24);
+        }
+        break;
+    }
+    }
+}
+
+void mmd_pmx_t::_read_faces(kaitai::kstream* p__io) {
+    size_t l_indices = (face_vertex_count() / 3) * 3;
+    uint8_t l_size = header()->vertex_index_size();
+    m_face_indices = std::unique_ptr<std::vector<uint32_t>>(new std::vector<uint32_t>());
+    if (l_size != 1 && l_size != 2 && l_size != 4) {
+        return;
+    }
+    m_face_indices->resize(l_indices);
+    uint64_t l_bytes = static_cast<uint64_t>(l_indices) * l_size;
+    const char* view = p__io->read_bytes_view(l_bytes);
+    if (view) {
+        widen_indices(reinterpret_cast<const uint8_t*>(view), l_size, l_indices, m_face_indices->data());
+    } else {
+        std::string bytes = p__io->read_bytes(l_bytes);
+        widen_indices(reinterpret_cast<const uint8_t*>(bytes.data()), l_size, l_indices, m_face_indices->data());
+    }
+}
+
+namespace {
+
+// Walks PMX records by their length rules without decoding or allocating
+// anything. Every method returns false instead of moving past the end of
+// the buffer, leaving a description and the offset of the offending field
+// in error() and error_offset().
+class section_scanner {
+public:
+    section_scanner(const uint8_t* p_data, uint64_t p_size, uint64_t p_pos, bool p_check_indices) {
+        m_data = p_data;
+        m_size = p_size;
+        m_pos = p_pos;
+        m_check_indices = p_check_indices;
+        m_error = nullptr;
+        m_error_offset = 0;
+        m_additional_uvs = 0;
+        m_vertex = m_texture = m_material = m_bone = m_morph = m_rigid_body = 0;
+        m_vertex_count = m_texture_count = 0;
+    }
+
+    uint64_t pos() const { return m_pos; }
+    void set_check_indices(bool p_check_indices) { m_check_indices = p_check_indices; }
+    const char* error() const { return m_error; }
+    uint64_t error_offset() const { return m_error_offset; }
+
+    bool scan_header();
+    bool scan_section(mmd_pmx_t::section_t p_section, std::vector<uint64_t>& r_vertex_chunks);
+
+private:
+    const uint8_t* m_data;
+    uint64_t m_size;
+    uint64_t m_pos;
+    bool m_check_indices;
+    const char* m_error;
+    uint64_t m_error_offset;
+
+    uint8_t m_additional_uvs;
+    uint8_t m_vertex;
+    uint8_t m_texture;
+    uint8_t m_material;
+    uint8_t m_bone;
+    uint8_t m_morph;
+    uint8_t m_rigid_body;
+    uint32_t m_vertex_count;
+    uint32_t m_texture_count;
+
+    bool fail(uint64_t p_offset, const char* p_error) {
+        m_error = p_error;
+        m_error_offset = p_offset;
+        return false;
+    }
+
+    bool skip(uint64_t p_bytes) {
+        if (p_bytes > m_size - m_pos) {
+            return fail(m_pos, "data runs past the end of the file");
+        }
+        m_pos += p_bytes;
+        return true;
+    }
+
+    // Checks that p_count records of at least p_min_bytes each can still
+    // fit, so no count is trusted further than the file can back it.
+    bool fits(uint64_t p_count, uint64_t p_min_bytes) {
+        if (p_count * p_min_bytes > m_size - m_pos) {
+            return fail(m_pos - 4, "count exceeds the bytes left in the file");
+        }
+        return true;
+    }
+
+    bool u1(uint8_t& r_value) {
+        if (m_pos >= m_size) {
+            return fail(m_pos, "data runs past the end of the file");
+        }
+        r_value = m_data[m_pos++];
+        return true;
+    }
+
+    bool u2(uint16_t& r_value) {
+        if (m_size - m_pos < 2) {
+            return fail(m_pos, "data runs past the end of the file");
+        }
+        r_value = m_data[m_pos] | (m_data[m_pos + 1] << 8);
+        m_pos += 2;
+        return true;
+    }
+
+    bool u4(uint32_t& r_value) {
+        if (m_size - m_pos < 4) {
+            return fail(m_pos, "data runs past the end of the file");
+        }
+        const uint8_t* p = m_data + m_pos;
+        r_value = p[0] | (p[1] << 8) | (p[2] << 16) | (static_cast<uint32_t>(p[3]) << 24);
+        m_pos += 4;
+        return true;
+    }
+
+    // Reads an unsigned index of p_size bytes where every value is valid,
+    // as vertex indices are.
+    bool unsigned_index(uint8_t p_size, uint32_t& r_value) {
+        if (m_size - m_pos < p_size) {
+            return fail(m_pos, "data runs past the end of the file");
+        }
+        const uint8_t* p = m_data + m_pos;
+        switch (p_size) {
+        case 1:
+            r_value = p[0];
+            break;
+        case 2:
+            r_value = p[0] | (p[1] << 8);
+            break;
+        default:
+            r_value = p[0] | (p[1] << 8) | (p[2] << 16) | (static_cast<uint32_t>(p[3]) << 24);
+            break;
+        }
+        m_pos += p_size;
+        return true;
+    }
+
+    // Reads an index of p_size bytes; all bits set means none.
+    bool index(uint8_t p_size, uint32_t& r_value) {
+        if (!unsigned_index(p_size, r_value)) {
+            return false;
+        }
+        if ((p_size == 1 && r_value == 0xFF) || (p_size == 2 && r_value == 0xFFFF)) {
+            r_value = 0xFFFFFFFF;
+        }
+        return true;
+    }
+
+    bool len_string() {
+        uint32_t l_length;
+        if (!u4(l_length)) {
+            return false;
+        }
+        if (l_length > m_size - m_pos) {
+            return fail(m_pos - 4, "string length exceeds the bytes left in the file");
+        }
+        m_pos += l_length;
+        return true;
+    }
+};
+
+bool section_scanner::scan_header() {
+    if (m_size - m_pos < 4 || memcmp(m_data + m_pos, "PMX ", 4) != 0) {
+        return fail(m_pos, "not a PMX file");
+    }
+    m_pos += 4;
+    uint8_t l_header_size;
+    uint8_t l_encoding;
+    if (!skip(4) || !u1(l_header_size) || !u1(l_encoding)) {
+        return false;
+    }
+    if (l_encoding > 1) {
+        return fail(m_pos - 1, "unknown string encoding");
+    }
+    if (!u1(m_additional_uvs)) {
+        return false;
+    }
+    if (m_additional_uvs > 4) {
+        return fail(m_pos - 1, "more than four additional UVs");
+    }
+    uint8_t* l_sizes[] = { &m_vertex, &m_texture, &m_material, &m_bone, &m_morph, &m_rigid_body };
+    for (int i = 0; i < 6; i++) {
+        if (!u1(*l_sizes[i])) {
+            return false;
+        }
+        if (*l_sizes[i] != 1 && *l_sizes[i] != 2 && *l_sizes[i] != 4) {
+            return fail(m_pos - 1, "index size is not 1, 2 or 4");
+        }
+    }
+    return len_string() && len_string() && len_string() && len_string();
+}
+
+bool section_scanner::scan_section(mmd_pmx_t::section_t p_section, std::vector<uint64_t>& r_vertex_chunks) {
+    uint32_t l_count;
+    if (!u4(l_count)) {
+        return false;
+    }
+    switch (p_section) {
+    case mmd_pmx_t::SECTION_VERTICES: {
+        // Position, normal, UV, additional UVs, then the weight type.
+        const uint64_t l_fixed = 32 + 16 * static_cast<uint64_t>(m_additional_uvs);
+        if (!fits(l_count, l_fixed + 1 + m_bone + 4)) {
+            return false;
+        }
+        m_vertex_count = l_count;
+        r_vertex_chunks.reserve(l_count / mmd_pmx_t::VERTEX_CHUNK_SIZE + 1);
+        for (uint32_t i = 0; i < l_count; i++) {
+            if (i % mmd_pmx_t::VERTEX_CHUNK_SIZE == 0) {
+                r_vertex_chunks.push_back(m_pos);
+            }
+            uint8_t l_type;
+            if (!skip(l_fixed) || !u1(l_type)) {
+                return false;
+            }
+            uint64_t l_weights = 0;
+            switch (l_type) {
+            case mmd_pmx_t::BONE_TYPE_BDEF1:
+                l_weights = m_bone;
+                break;
+            case mmd_pmx_t::BONE_TYPE_BDEF2:
+                l_weights = 2 * m_bone + 4;
+                break;
+            case mmd_pmx_t::BONE_TYPE_SDEF:
+                l_weights = 2 * m_bone + 4 + 36;
+                break;
+            case mmd_pmx_t::BONE_TYPE_BDEF4:
+            case mmd_pmx_t::BONE_TYPE_QDEF:
+                l_weights = 4 * m_bone + 16;
+                break;
+            default:
+                return fail(m_pos - 1, "unknown vertex weight type");
+            }
+            // Weights, then the edge ratio.
+            if (!skip(l_weights + 4)) {
+                return false;
+            }
+        }
+        return true;
+    }
+    case mmd_pmx_t::SECTION_FACES: {
+        // Matches _read_faces(), which ignores a trailing partial triangle.
+        uint64_t l_indices = static_cast<uint64_t>(l_count / 3) * 3;
+        if (!m_check_indices) {
+            return skip(l_indices * m_vertex);
+        }
+        if (!fits(l_indices, m_vertex)) {
+            return false;
+        }
+        for (uint64_t i = 0; i < l_indices; i++) {
+            uint32_t l_index;
+            if (!unsigned_index(m_vertex, l_index)) {
+                return false;
+            }
+            if (l_index >= m_vertex_count) {
+                return fail(m_pos - m_vertex, "face refers to a vertex that does not exist");
+            }
+        }
+        return true;
+    }
+    case mmd_pmx_t::SECTION_TEXTURES: {
+        if (!fits(l_count, 4)) {
+            return false;
+        }
+        m_texture_count = l_count;
+        for (uint32_t i = 0; i < l_count; i++) {
+            if (!len_string()) {
+                return false;
+            }
+        }
+        return true;
+    }
+    case mmd_pmx_t::SECTION_MATERIALS: {
+        if (!fits(l_count, 4 + 4 + 16 + 12 + 4 + 12 + 1 + 16 + 4 + 2 * m_texture + 2 + 4 + 4)) {
+            return false;
+        }
+        for (uint32_t i = 0; i < l_count; i++) {
+            // Colors, shininess, flags and edge, then the texture and sphere
+            // texture indices, the sphere mode and the toon flag.
+            uint32_t l_textures[2];
+            uint8_t l_is_common_toon;
+            if (!len_string() || !len_string() || !skip(16 + 12 + 4 + 12 + 1 + 16 + 4) || !index(m_texture, l_textures[0]) || !index(m_texture, l_textures[1]) || !skip(1) || !u1(l_is_common_toon)) {
+                return false;
+            }
+            if (m_check_indices) {
+                for (int j = 0; j < 2; j++) {
+                    if (l_textures[j] != 0xFFFFFFFF && l_textures[j] >= m_texture_count) {
+                        return fail(m_pos - 2 - (2 - j) * m_texture, "material refers to a texture that does not exist");
+                    }
+                }
+            }
+            uint64_t l_toon = l_is_common_toon == 0 ? m_texture : (l_is_common_toon == 1 ? 1 : 0);
+            if (!skip(l_toon) || !len_string() || !skip(4)) {
+                return false;
+            }
+        }
+        return true;
+    }
+    case mmd_pmx_t::SECTION_BONES: {
+        if (!fits(l_count, 4 + 4 + 12 + m_bone + 4 + 2)) {
+            return false;
+        }
+        for (uint32_t i = 0; i < l_count; i++) {
+            uint16_t l_flags;
+            if (!len_string() || !len_string() || !skip(12 + m_bone + 4) || !u2(l_flags)) {
+                return false;
+            }
+            uint64_t l_bytes = (l_flags & 0x0001) ? m_bone : 12;
+            if (l_flags & 0x0300) {
+                l_bytes += m_bone + 4;
+            }
+            if (l_flags & 0x0400) {
+                l_bytes += 12;
+            }
+            if (l_flags & 0x0800) {
+                l_bytes += 24;
+            }
+            if (l_flags & 0x2000) {
+                l_bytes += 4;
+            }
+            if (!skip(l_bytes)) {
+                return false;
+            }
+            if (l_flags & 0x0020) {
+                uint32_t l_links;
+                if (!skip(m_bone + 8) || !u4(l_links) || !fits(l_links, m_bone + 1)) {
+                    return false;
+                }
+                for (uint32_t j = 0; j < l_links; j++) {
+                    uint8_t l_limited;
+                    if (!skip(m_bone) || !u1(l_limited) || !skip(l_limited == 1 ? 24 : 0)) {
+                        return false;
+                    }
+                }
+            }
+        }
+        return true;
+    }
+    case mmd_pmx_t::SECTION_MORPHS: {
+        if (!fits(l_count, 4 + 4 + 1 + 1 + 4)) {
+            return false;
+        }
+        for (uint32_t i = 0; i < l_count; i++) {
+            uint8_t l_type;
+            uint32_t l_elements;
+            if (!len_string() || !len_string() || !skip(1) || !u1(l_type)) {
+                return false;
+            }
+            uint64_t l_element = 0;
+            switch (l_type) {
+            case mmd_pmx_t::MORPH_TYPE_GROUP:
+            case mmd_pmx_t::MORPH_TYPE_FLIP:
+                l_element = m_morph + 4;
+                break;
+            case mmd_pmx_t::MORPH_TYPE_VERTEX:
+                l_element = m_vertex + 12;
+                break;
+            case mmd_pmx_t::MORPH_TYPE_BONE:
+                l_element = m_bone + 12 + 16;
+                break;
+            case mmd_pmx_t::MORPH_TYPE_UV:
+            case mmd_pmx_t::MORPH_TYPE_ADDITIONAL_UV1:
+            case mmd_pmx_t::MORPH_TYPE_ADDITIONAL_UV2:
+            case mmd_pmx_t::MORPH_TYPE_ADDITIONAL_UV3:
+            case mmd_pmx_t::MORPH_TYPE_ADDITIONAL_UV4:
+                l_element = m_vertex + 16;
+                break;
+            case mmd_pmx_t::MORPH_TYPE_MATERIAL:
+                l_element = m_material + 1 + 28 * 4;
+                break;
+            case mmd_pmx_t::MORPH_TYPE_IMPULSE:
+                l_element = m_rigid_body + 1 + 24;
+                break;
+            default:
+                // The parser reads nothing for unknown types, so any element
+                // count would be allocated without backing bytes.
+                return fail(m_pos - 1, "unknown morph type");
+            }
+            if (!u4(l_elements) || !fits(l_elements, l_element)) {
+                return false;
+            }
+            m_pos += l_element * l_elements;
+        }
+        return true;
+    }
+    case mmd_pmx_t::SECTION_FRAMES: {
+        if (!fits(l_count, 4 + 4 + 1 + 4)) {
+            return false;
+        }
+        for (uint32_t i = 0; i < l_count; i++) {
+            uint32_t l_elements;
+            if (!len_string() || !len_string() || !skip(1) || !u4(l_elements) || !fits(l_elements, 1 + m_bone)) {
+                return false;
+            }
+            for (uint32_t j = 0; j < l_elements; j++) {
+                uint8_t l_target;
+                if (!u1(l_target) || !skip(l_target == 0 ? m_bone : m_morph)) {
+                    return false;
+                }
+            }
+        }
+        return true;
+    }
+    case mmd_pmx_t::SECTION_RIGID_BODIES: {
+        // Group, mask, shape, size, position, rotation, five physics
+        // parameters and the mode.
+        const uint64_t l_fixed = m_bone + 1 + 2 + 1 + 36 + 20 + 1;
+        if (!fits(l_count, 4 + 4 + l_fixed)) {
+            return false;
+        }
+        for (uint32_t i = 0; i < l_count; i++) {
+            if (!len_string() || !len_string() || !skip(l_fixed)) {
+                return false;
+            }
+        }
+        return true;
+    }
+    case mmd_pmx_t::SECTION_JOINTS: {
+        const uint64_t l_fixed = 1 + 2 * m_rigid_body + 8 * 12;
+        if (!fits(l_count, 4 + 4 + l_fixed)) {
+            return false;
+        }
+        for (uint32_t i = 0; i < l_count; i++) {
+            if (!len_string() || !len_string() || !skip(l_fixed)) {
+                return false;
+            }
+        }
+        return true;
+    }
+    default:
+        return true;
+    }
+}
+
+// Number of sections up to and including the last one in p_section_mask.
+int section_limit(uint32_t p_section_mask) {
+    int l_sections = 0;
+    for (int i = 0; i < mmd_pmx_t::SECTION_COUNT; i++) {
+        if (p_section_mask & (1u << i)) {
+            l_sections = i + 1;
+        }
+    }
+    return l_sections;
+}
+
+}
+
+bool mmd_pmx_t::validate(const char* p_data, uint64_t p_size, uint32_t p_section_mask, uint64_t* r_error_offset, const char** r_error) {
+    // Sections before the last requested one still have their counts
+    // checked, since they have to be walked to find it, but only requested
+    // sections have their indices checked.
+    section_scanner l_scanner(reinterpret_cast<const uint8_t*>(p_data), p_size, 0, false);
+    std::vector<uint64_t> l_vertex_chunks;
+    const int l_sections = section_limit(p_section_mask);
+    bool l_valid = l_scanner.scan_header();
+    for (int i = 0; l_valid && i < l_sections; i++) {
+        l_scanner.set_check_indices((p_section_mask & (1u << i)) != 0);
+        l_valid = l_scanner.scan_section(static_cast<section_t>(i), l_vertex_chunks);
+    }
+    if (!l_valid) {
+        *r_error_offset = l_scanner.error_offset();
+        *r_error = l_scanner.error();
+    }
+    return l_valid;
+}
+
+void mmd_pmx_t::_scan_sections(uint64_t p_header_offset, uint32_t p_section_mask) {
+    // Index ranges are left to validate(); this pass only has to keep every
+    // section inside the buffer.
+    section_scanner l_scanner(reinterpret_cast<const uint8_t*>(m__io->buffer()), m__io->size(), p_header_offset, false);
+    std::vector<uint64_t> l_vertex_chunks;
+    const int l_sections = section_limit(p_section_mask);
+    bool l_valid = l_scanner.scan_header();
+    for (int i = 0; l_valid && i < l_sections; i++) {
+        m__section_offsets[i] = l_scanner.pos();
+        l_valid = l_scanner.scan_section(static_cast<section_t>(i), l_vertex_chunks);
+    }
+    if (!l_valid) {
+        throw std::ios_base::failure(std::string("scan: ") + l_scanner.error() + " at offset " + std::to_string(l_scanner.error_offset()));
+    }
+    m__section_offsets[l_sections] = l_scanner.pos();
+    m__sections_located = l_sections;
+    m__vertex_chunks.resize(l_vertex_chunks.size());
+    for (size_t i = 0; i < l_vertex_chunks.size(); i++) {
+        m__vertex_chunks[i].offset = l_vertex_chunks[i];
+    }
+}
+
+int32_t mmd_pmx_t::_read_signed_index(kaitai::kstream* p__io, uint8_t p_size) {
+    switch (p_size) {
+    case 1:
+        return p__io->read_s1();
+    case 2:
+        return p__io->read_s2le();
+    case 4:
+        return p__io->read_s4le();
+    }
+    return -1;
+}
+
 mmd_pmx_t::~mmd_pmx_t() {
     _clean_up();
 }
@@ -919,6 +1728,7 @@ void mmd_pmx_t::header_t::_read() {
     m_version = m__io->read_f4le();
     m_header_size = m__io->read_u1();
     m_encoding = m__io->read_u1();
+    m__root->m_string_encoding = m_encoding;
     m_additional_uv_count = m__io->read_u1();
     m_vertex_index_size = m__io->read_u1();
     m_texture_index_size = m__io->read_u1();
@@ -1169,7 +1979,54 @@ mmd_pmx_t::len_string_t::len_string_t(kaitai::kstream* p__io, kaitai::kstruct* p
 
 void mmd_pmx_t::len_string_t::_read() {
     m_length = m__io->read_u4le();
-    m_value = kaitai::kstream::bytes_to_str(m__io->read_bytes(length()), std::string("UTF-16LE"));
+    m_encoding = _root()->string_encoding();
+    m_raw = m__io->read_bytes(length());
+}
+
+static void append_utf8(std::string& r_out, uint32_t p_code_point) {
+    if (p_code_point < 0x80) {
+        r_out.push_back(static_cast<char>(p_code_point));
+    } else if (p_code_point < 0x800) {
+        r_out.push_back(static_cast<char>(0xC0 | (p_code_point >> 6)));
+        r_out.push_back(static_cast<char>(0x80 | (p_code_point & 0x3F)));
+    } else if (p_code_point < 0x10000) {
+        r_out.push_back(static_cast<char>(0xE0 | (p_code_point >> 12)));
+        r_out.push_back(static_cast<char>(0x80 | ((p_code_point >> 6) & 0x3F)));
+        r_out.push_back(static_cast<char>(0x80 | (p_code_point & 0x3F)));
+    } else {
+        r_out.push_back(static_cast<char>(0xF0 | (p_code_point >> 18)));
+        r_out.push_back(static_cast<char>(0x80 | ((p_code_point >> 12) & 0x3F)));
+        r_out.push_back(static_cast<char>(0x80 | ((p_code_point >> 6) & 0x3F)));
+        r_out.push_back(static_cast<char>(0x80 | (p_code_point & 0x3F)));
+    }
+}
+
+std::string mmd_pmx_t::len_string_t::value() const {
+    if (m_encoding == 1) {
+        return m_raw;
+    }
+    // UTF-16LE. Unpaired surrogates become U+FFFD and an odd trailing byte
+    // is dropped.
+    const uint8_t* src = reinterpret_cast<const uint8_t*>(m_raw.data());
+    size_t units = m_raw.size() / 2;
+    std::string result;
+    result.reserve(units * 3);
+    for (size_t i = 0; i < units; i++) {
+        uint32_t c = src[i * 2] | (src[i * 2 + 1] << 8);
+        if (c >= 0xD800 && c <= 0xDBFF && i + 1 < units) {
+            uint32_t low = src[i * 2 + 2] | (src[i * 2 + 3] << 8);
+            if (low >= 0xDC00 && low <= 0xDFFF) {
+                c = 0x10000 + ((c - 0xD800) << 10) + (low - 0xDC00);
+                i++;
+            } else {
+                c = 0xFFFD;
+            }
+        } else if (c >= 0xD800 && c <= 0xDFFF) {
+            c = 0xFFFD;
+        }
+        append_utf8(result, c);
+    }
+    return result;
 }
 
 mmd_pmx_t::len_string_t::~len_string_t() {
@@ -103,10 +103,105 @@ public:
         BONE_TYPE_QDEF = 4
     };
 
+    /**
+     * Top-level sections following the header, in file order. Each one
+     * starts with its u4 element count.
+     */
+    enum section_t {
+        SECTION_VERTICES,
+        SECTION_FACES,
+        SECTION_TEXTURES,
+        SECTION_MATERIALS,
+        SECTION_BONES,
+        SECTION_MORPHS,
+        SECTION_FRAMES,
+        SECTION_RIGID_BODIES,
+        SECTION_JOINTS,
+        SECTION_COUNT
+    };
+
+    /**
+     * READ_MODE_ALL parses the whole file in the constructor.
+     * READ_MODE_DEFERRED reads the header, locates every section with a
+     * byte-level scan and stops; each section is then parsed by
+     * read_section(). Deferred mode needs a memory-backed stream.
+     */
+    enum read_mode_t {
+        READ_MODE_ALL,
+        READ_MODE_DEFERRED
+    };
+
     mmd_pmx_t(kaitai::kstream* p__io, kaitai::kstruct* p__parent = nullptr, mmd_pmx_t* p__root = nullptr);
 
+    /**
+     * In deferred mode p_section_mask holds a (1 << section_t) bit for every
+     * section the caller intends to read. The scan stops after the last of
+     * them; sections past it are never located and cannot be read. Sections
+     * before it are located (every record has to be walked to find the
+     * next section) but cost nothing further unless read.
+     */
+    mmd_pmx_t(kaitai::kstream* p__io, read_mode_t p_read_mode, uint32_t p_section_mask = (1u << SECTION_COUNT) - 1);
+
+    /**
+     * Parses one section located by the deferred constructor from its own
+     * stream. Different sections may be read concurrently from different
+     * threads; each one allocates from its own arena and only reads the
+     * header. Reading a section twice is a no-op.
+     */
+    void read_section(section_t p_section);
+
+    /**
+     * Checks that a PMX file held in memory can be parsed without reading
+     * past its end or allocating more than it can back: the header is
+     * well-formed, every count fits in the bytes left, weight and morph
+     * types are known, and face and material texture indices are in range.
+     * Like the deferred constructor it stops after the last section in
+     * p_section_mask, and only checks indices in the sections the mask
+     * names. Nothing is allocated and nothing is thrown. On failure returns
+     * false with the offset of the offending field and a static description.
+     */
+    static bool validate(const char* p_data, uint64_t p_size, uint32_t p_section_mask, uint64_t* r_error_offset, const char** r_error);
+
+    /** Whether a section's bounds are known, so it can be read. */
+    bool section_located(section_t p_section) const { return p_section < m__sections_located; }
+
+    /**
+     * Vertices per chunk of the vertex section. The deferred constructor
+     * records where each chunk starts while it scans, so chunks can be
+     * decoded independently of each other.
+     */
+    static const uint32_t VERTEX_CHUNK_SIZE = 16384;
+
+    /**
+     * Chunked alternative to read_section(SECTION_VERTICES) in deferred
+     * mode. begin_vertex_chunks() allocates the whole vertex table and
+     * returns the number of chunks (0 if the vertices are already read).
+     * read_vertex_chunk() decodes one chunk in place and may run for
+     * different chunks on different threads at once. end_vertex_chunks()
+     * merges the per-chunk SDEF lists in vertex order once all are done.
+     */
+    uint32_t begin_vertex_chunks();
+    void read_vertex_chunk(uint32_t p_chunk);
+    void end_vertex_chunks();
+
+    /**
+     * Appends a copy of vertex p_vertex to the vertex table, without its
+     * SDEF parameters, and returns the copy's index. Lets a consumer give
+     * some faces their own version of a shared vertex.
+     */
+    uint32_t duplicate_vertex(uint32_t p_vertex);
+
 private:
+    struct vertex_chunk_t {
+        uint64_t offset;
+        std::vector<uint32_t> sdef_vertices;
+        std::vector<float> sdef_params;
+    };
+
+    void _init(read_mode_t p_read_mode, uint32_t p_section_mask);
     void _read();
+    void _scan_sections(uint64_t p_header_offset, uint32_t p_section_mask);
+    void _read_section(section_t p_section, kaitai::kstream* p__io);
     void _clean_up();
 
 public:
@@ -1447,23 +1542,94 @@ public:
 
     private:
         uint32_t m_length;
-        std::string m_value;
+        uint8_t m_encoding;
+        std::string m_raw;
         mmd_pmx_t* m__root;
         kaitai::kstruct* m__parent;
 
     public:
         uint32_t length() const { return m_length; }
-        std::string value() const { return m_value; }
+
+        /**
+         * The string transcoded to UTF-8.
+         */
+        std::string value() const;
+
+        /**
+         * The undecoded bytes, in the encoding given by encoding().
+         */
+        const std::string& raw() const { return m_raw; }
+
+        /**
+         * header.encoding at the time the string was read: 0 for UTF-16LE,
+         * 1 for UTF-8.
+         */
+        uint8_t encoding() const { return m_encoding; }
         mmd_pmx_t* _root() const { return m__root; }
         kaitai::kstruct* _parent() const { return m__parent; }
     };
 
+    /**
+     * All vertices of the model, decoded into one flat array per attribute
+     * instead of a vertex_t object per vertex. Vectors are stored as
+     * consecutive floats, so vertex i's position is positions[i * 3 + 0..2].
+     */
+
+    struct vertex_table_t {
+        std::vector<float> positions;
+        std::vector<float> normals;
+        std::vector<float> uvs;
+
+        /**
+         * header.additional_uv_count vec4s per vertex.
+         */
+        std::vector<float> additional_uvs;
+        std::vector<uint8_t> weight_types;
+
+        /**
+         * Four bone slots per vertex, sign-extended from the file's
+         * bone_index_size. Unused slots and null bones are -1. BDEF1 and
+         * BDEF2/SDEF fill the first one and two slots.
+         */
+        std::vector<int32_t> bone_indices;
+
+        /**
+         * Four weights per vertex matching bone_indices. BDEF1 stores 1.0
+         * and BDEF2/SDEF store weight1 and 1.0 - weight1.
+         */
+        std::vector<float> weights;
+
+        /**
+         * SDEF vertices only: the vertex index, and its c, r0 and r1 vectors
+         * as nine floats.
+         */
+        std::vector<uint32_t> sdef_vertices;
+        std::vector<float> sdef_params;
+        std::vector<float> edge_ratios;
+    };
+
 private:
+    void _read_vertices(kaitai::kstream* p__io);
+    void _allocate_vertices();
+    void _read_vertex_range(kaitai::kstream* p__io, size_t p_begin, size_t p_end, std::vector<uint32_t>& r_sdef_vertices, std::vector<float>& r_sdef_params);
+    void _read_faces(kaitai::kstream* p__io);
+    static int32_t _read_signed_index(kaitai::kstream* p__io, uint8_t p_size);
+
+    // Declared first so they are destroyed last: every object below was
+    // allocated from one of them. There is one arena per section, and the
+    // last one holds the header.
+    std::unique_ptr<kaitai::kstruct_arena> m__arenas[SECTION_COUNT + 1];
+    std::unique_ptr<kaitai::kstream> m__section_ios[SECTION_COUNT];
+    uint64_t m__section_offsets[SECTION_COUNT + 1];
+    bool m__section_read[SECTION_COUNT];
+    int m__sections_located;
+    std::vector<vertex_chunk_t> m__vertex_chunks;
+    uint8_t m_string_encoding;
     std::unique_ptr<header_t> m_header;
     uint32_t m_vertex_count;
-    std::unique_ptr<std::vector<std::unique_ptr<vertex_t>>> m_vertices;
+    std::unique_ptr<vertex_table_t> m_vertices;
     uint32_t m_face_vertex_count;
-    std::unique_ptr<std::vector<std::unique_ptr<face_t>>> m_faces;
+    std::unique_ptr<std::vector<uint32_t>> m_face_indices;
     uint32_t m_texture_count;
     std::unique_ptr<std::vector<std::unique_ptr<texture_t>>> m_textures;
     uint32_t m_material_count;
@@ -1483,10 +1649,35 @@ private:
 
 public:
     header_t* header() const { return m_header.get(); }
+
+    /**
+     * Encoding of every len_string in the file, copied from the header as
+     * soon as it is read so the header's own strings can use it.
+     */
+    uint8_t string_encoding() const { return m_string_encoding; }
+
+    /**
+     * Stream offset of a located section's element count. The offset of the
+     * section after the last located one is where that one ends.
+     */
+    uint64_t section_offset(section_t p_section) const { return m__section_offsets[p_section]; }
+
+    /**
+     * Arena a section's objects were allocated from; SECTION_COUNT is the
+     * header's. Objects reachable from this parse must not be moved out of
+     * it: they live only as long as the mmd_pmx_t that owns the arenas.
+     */
+    kaitai::kstruct_arena* _arena(section_t p_section) const { return m__arenas[p_section].get(); }
     uint32_t vertex_count() const { return m_vertex_count; }
-    std::vector<std::unique_ptr<vertex_t>>* vertices() const { return m_vertices.get(); }
+    vertex_table_t* vertices() const { return m_vertices.get(); }
     uint32_t face_vertex_count() const { return m_face_vertex_count; }
-    std::vector<std::unique_ptr<face_t>>* faces() const { return m_faces.get(); }
+
+    /**
+     * Vertex indices of all triangles, three per face, widened to 32 bits
+     * from the header's vertex_index_size. Materials consume consecutive
+     * ranges of face_vertex_count() indices in order.
+     */
+    std::vector<uint32_t>* face_indices() const { return m_face_indices.get(); }
     uint32_t texture_count() const { return m_texture_count; }
     std::vector<std::unique_ptr<texture_t>>* textures() const { return m_textures.get(); }
     uint32_t material_count() const { return m_material_count; }